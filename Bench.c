@@ -0,0 +1,293 @@
+/*
+ * Bench
+ * 	TeleInfod's parser benchmark.
+ *
+ *	Bundled captures (trame_standard, trame_triphase and trame_historique), repeated
+ *	many times, are fed through TeleInfod's own processing threads
+ *	(process_standard() and process_historic()) ; messages are published
+ *	to a null sink. Figures are printed on a single line per kind of
+ *	frame, so they can be compared from a commit to another.
+ *
+ *	trame_coupee holds a complete frame, one cut by EOT in the middle of
+ *	a group then the complete frame again : the run fails if the cut
+ *	frame isn't reported as interrupted.
+ *
+ * Compilation :
+make bench
+ * Usage :
+./TeleInfod_bench [-n repeat] [-s standard capture] [-t three-phase capture] [-H historic capture] [-c cut capture]
+ *
+ *	Allocations are counted : a run must not need any once frames are
+ *	flowing. With SMALL_FOOTPRINT, the startup arena is sealed before
+ *	running, so any allocation aborts.
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include "src/TeleInfod.h"
+#include "src/Config.h"
+
+	/* **
+	 * Allocations' counter
+	 * **/
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static atomic_ulong nballoc;
+
+void *malloc(size_t sz){
+	atomic_fetch_add(&nballoc, 1);
+	return __libc_malloc(sz);
+}
+
+void *calloc(size_t n, size_t sz){
+	atomic_fetch_add(&nballoc, 1);
+	return __libc_calloc(n, sz);
+}
+
+void *realloc(void *p, size_t sz){
+	atomic_fetch_add(&nballoc, 1);
+	return __libc_realloc(p, sz);
+}
+
+static void memoryReport(unsigned long startup){
+/* Startup's allocations and resident memory */
+	char l[256];
+	unsigned long hwm = 0, rss = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if(f){
+		while(fgets(l, sizeof(l), f))
+			if(!strncmp(l, "VmHWM:", 6))
+				hwm = strtoul(l + 6, NULL, 10);
+			else if(!strncmp(l, "VmRSS:", 6))
+				rss = strtoul(l + 6, NULL, 10);
+		fclose(f);
+	}
+
+	printf("memory   : %lu allocations at startup, RSS %lu KB (peak %lu KB)\n", startup, rss, hwm);
+}
+
+	/* **
+	 * Null broker
+	 * **/
+static unsigned long nbpub;
+
+int papub(const char *topic, int length, void *payload, int retained, const struct PubTrack *t){
+	nbpub++;
+#ifdef LATENCY_STATS
+	if(t && t->section)	/* delivered at once, as with QoS 0 */
+		latencyDelivered(t);
+#endif
+	return 0;
+}
+
+bool brokerConnected(void){
+	return true;
+}
+
+void brokerReconnect(void){
+}
+
+	/* **
+	 * Benchmark
+	 * **/
+static const char *replicate(const char *capture, unsigned int repeat){
+/* Create a temporary file containing the capture repeated
+ * <- its name
+ */
+	static char buf[1024*1024];
+	char *name;
+	int in, out;
+	ssize_t len;
+
+	if((in = open(capture, O_RDONLY)) == -1){
+		perror(capture);
+		exit(EXIT_FAILURE);
+	}
+	len = read(in, buf, sizeof(buf));
+	close(in);
+	if(len <= 0){
+		fprintf(stderr, "*F* Can't read '%s'\n", capture);
+		exit(EXIT_FAILURE);
+	}
+
+	assert( (name = strdup("/tmp/TeleInfod_benchXXXXXX")) );
+	if((out = mkstemp(name)) == -1){
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	for(unsigned int i=0; i<repeat; i++)
+		assert( write(out, buf, len) == len );
+	close(out);
+
+	return name;
+}
+
+static void *warmup(void *dummy){
+	pthread_exit(NULL);
+}
+
+static sem_t go;
+static struct CSection *current;
+static void *(*currentprocess)(void *);
+
+static void *runner(void *dummy){
+/* Thread's creation isn't measured */
+	sem_wait(&go);
+	return currentprocess(current);
+}
+
+static void run(struct CSection *s, void *(*process)(void *)){
+	struct timespec start, end;
+	pthread_t thread;
+
+	current = s;
+	currentprocess = process;
+	assert(!pthread_create(&thread, NULL, runner, NULL));
+
+	atomic_store(&nballoc, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	sem_post(&go);
+	assert(!pthread_join(thread, NULL));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long allocs = atomic_load(&nballoc);
+
+	while(atomic_load(&s->queue.tail) != atomic_load(&s->queue.head))
+		usleep(1000);	/* Let the publisher finish */
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-8s : %lu groups (%lu bad), %lu frames, %lu bytes in %.3f s : "
+		"%.0f groups/s, %.0f frames/s, %.1f ns/group, %.1f MB/s, "
+		"%lu allocations, %lu published, %lu dropped\n",
+		s->name, s->rd.nbgood, s->rd.nbbad, s->rd.nbframes, s->rd.nbbytes, elapsed,
+		s->rd.nbgood / elapsed, s->rd.nbframes / elapsed, elapsed * 1e9 / s->rd.nbgood,
+		s->rd.nbbytes / elapsed / 1e6,
+		allocs, atomic_load(&s->queue.published), atomic_load(&s->queue.dropped)
+	);
+
+	unlink(s->port);
+}
+
+static struct CSection *newSection(const char *name, const char *capture, bool standard, unsigned int repeat){
+	struct CSection *s = calloc(1, sizeof(struct CSection));
+	assert(s);
+
+	s->name = name;
+	s->port = replicate(capture, repeat);
+	s->standard = standard;
+	s->labels = "*";	/* all known labels */
+	s->topic = standard ? "Bench/Standard" : "Bench/Historic";
+	if(standard){
+		s->cctopic = "Bench/Consumer";
+		s->cptopic = "Bench/Producer";
+	}
+	s->databits = 7;
+	s->parity = 'E';
+	s->stopbits = 1;
+	s->vmin = 1;
+
+	compileLabels(s);
+	if(standard)
+		initStandard(s);
+	else
+		initHistoric(s);
+	initBatch(s);
+	initQueue(&s->queue, 16*1024*1024);
+
+	return s;
+}
+
+int main(int ac, char **av){
+	unsigned int repeat = 1000;
+	const char *standard = "trame_standard";
+	const char *triphase = "trame_triphase";	/* 9 characters labels */
+	const char *historic = "trame_historique";
+	const char *cut = "trame_coupee";	/* complete, cut by EOT, complete */
+
+	int opt;
+	while((opt = getopt(ac, av, "hn:s:t:H:c:")) != -1){
+		switch(opt){
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 's':
+			standard = optarg;
+			break;
+		case 't':
+			triphase = optarg;
+			break;
+		case 'H':
+			historic = optarg;
+			break;
+		case 'c':
+			cut = optarg;
+			break;
+		default:
+			fprintf(stderr, "%s [-n repeat (%u)] [-s standard capture] [-t three-phase capture] [-H historic capture] [-c cut capture]\n", av[0], repeat);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	atomic_store(&nballoc, 0);
+
+		/* Processing threads end with pthread_exit() at the end of the
+		 * capture : the first one loads the unwinder. As TeleInfod's never
+		 * end, it's done here, outside measures */
+	pthread_t thread;
+	sem_init(&go, 0, 0);
+	assert(!pthread_create(&thread, NULL, warmup, NULL));
+	assert(!pthread_join(thread, NULL));
+
+	struct CSection *std = newSection("standard", standard, true, repeat);
+	struct CSection *tri = newSection("triphase", triphase, true, repeat);
+	struct CSection *his = newSection("historic", historic, false, repeat);
+	struct CSection *cop = newSection("cut", cut, true, repeat);
+	std->next = tri;
+	tri->next = his;
+	his->next = cop;
+
+#ifdef LATENCY_STATS
+	initLatency(std, NULL, 0);
+#endif
+	startPublisher(std, DEFAULT_REPLAY_RATE);
+	unsigned long startup = atomic_load(&nballoc);
+#ifdef SMALL_FOOTPRINT
+	arenaSeal();
+#endif
+
+	run(std, process_standard);
+	run(tri, process_standard);
+	run(his, process_historic);
+	run(cop, process_standard);
+
+	printf("%lu messages sent to the null broker\n", nbpub);
+	memoryReport(startup);
+
+	if(cop->rd.nbframes != 2*repeat || cop->rd.nbaborted != repeat){
+		fprintf(stderr, "*F* '%s' : %lu complete and %lu interrupted frames, %u and %u expected\n", cut, cop->rd.nbframes, cop->rd.nbaborted, 2*repeat, repeat);
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
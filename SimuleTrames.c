@@ -1,24 +1,53 @@
 /*
  * SimuleTrames
- * 	Quick and dirty TeleInfod companion that sends double 
- * 	"TeleInformation" frame, one with HC/HP (consommation), another
- * 	with BASE (production), to FIFO pipes.
+ * 	TeleInfod companion : load generator and soak test.
  *
- *	SimuleTrames is used to test TeleInfod.
+ *	Feeds FIFOs (or PTYs with -p) with valid "TeleInformation" frames :
+ *	historic ones (a consumption frame with HC/HP and a production one
+ *	with BASE, on <dir>/conso<n> and <dir>/prod<n>) or, with -s,
+ *	standard ones (<dir>/std<n>), -r frames per second on each of them.
+ *	Without -n, a single meter is fed through <dir>/conso and <dir>/prod
+ *	(or <dir>/std). -c only prints the matching TeleInfod configuration.
+ *
+ *	Faults can be injected : -C percent of groups with a bad checksum,
+ *	-T percent of frames truncated in the middle of a group, -E percent
+ *	of frames interrupted by an EOT.
+ *	Writes never block : bytes a slow reader can't absorb are counted
+ *	as overruns (as a real serial line would lose them).
+ *
+ *	With -b, a minimal MQTT broker listens on 127.0.0.1:<port> and only
+ *	counts (and acknowledges) messages it receives : pointing TeleInfod
+ *	to it (-c adds the right Broker_Host=) measures its end-to-end
+ *	throughput. MQTT 5 clients are allowed -A topic aliases (65535 by
+ *	default, 0 to measure what they save : compare bytes per message).
+ *	As the printed configuration publishes every field at
+ *	each frame, each valid group is expected to give a message (two for
+ *	horodated values) : the "delivered" ratio shows what got lost.
+ *	Groups of cut frames (-T, -E) aren't expected, as TeleInfod only
+ *	publishes complete frames : they are counted apart ("cut").
+ *	With -P, CPU usage and RSS of TeleInfod (given by its pid or its
+ *	name) are sampled as well.
+ *
+ *	Figures are printed every -i seconds and summarised, on a single
+ *	line, when leaving (after -D seconds or on ^C).
  *
  * Compilation :
 gcc -Wall SimuleTrames.c -o SimuleTrames
- * or
-gcc -DSTRESS=10000 -Wall SimuleTrames.c -o SimuleTrames
+ * Usage :
+./SimuleTrames [-n meters] [-d directory] [-s] [-p] [-r rate] [-C %] [-T %] [-E %] [-b port] [-A aliases] [-P pid|name] [-i interval] [-D duration] [-c]
+ * Soak test example :
+./SimuleTrames -n 50 -d /tmp/fifos -b 1884 -c > /tmp/soak.conf
+./SimuleTrames -n 50 -d /tmp/fifos -b 1884 -r 2 -C 1 -D 3600 -P TeleInfod &
+TeleInfod -f /tmp/soak.conf
  *
  * Copyright 2015 Laurent Faillie
  *
- * 		TeleInfod is covered by 
+ * 		TeleInfod is covered by
  *      Creative Commons Attribution-NonCommercial 3.0 License
- *      (http://creativecommons.org/licenses/by-nc/3.0/) 
+ *      (http://creativecommons.org/licenses/by-nc/3.0/)
  *      Consequently, you're free to use if for personal or non-profit usage,
  *      professional or commercial usage REQUIRES a commercial licence.
- *  
+ *
  *      TeleInfod is distributed in the hope that it will be useful,
  *      but WITHOUT ANY WARRANTY; without even the implied warranty of
  *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
@@ -26,91 +55,747 @@ gcc -DSTRESS=10000 -Wall SimuleTrames.c -o SimuleTrames
  *	23/08/2015 - v1		LF - First version
  *	22/10/2015 - v1.1 	LF - Add some fields + conditionally compile the production frame
  *	16/07/2016 - v1.2	LF - w/ STRESS set, usleep replace sleep to flood the network
+ *	17/10/2024 - v2.0	LF - Valid checksums + many meters
+ *	17/10/2024 - v3.0	LF - Load generator : rate, standard frames, PTYs, faults,
+ *							MQTT sink and soak figures (STRESS is replaced by -r)
+ *	17/10/2024 - v3.1	LF - Sink : MQTT 5 topic aliases (-A), bytes per message
  */
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <time.h>
-#ifdef STRESS
-#include <unistd.h>
-#endif
+#include <dirent.h>
 
-#define FCONSO "/tmp/conso"
-#define FPROD "/tmp/prod"
+#define FCONSO "conso"
+#define FPROD "prod"
+#define FSTD "std"
 
-	/* Notez-bien : QUICK & DIRTY ! */
+#define MAXFRAME 2048	/* Largest generated frame */
+#define MAXGROUPS 32	/* Groups per frame */
+#define MAXCLIENTS 16	/* Sink's connections */
+#define CLIENTBUF 65536	/* Sink's reception buffer */
 
-FILE *fdp=NULL, *fdc=NULL;
+enum kind { K_CONSO, K_PROD, K_STD };
 
-void theend( void ){
-	fclose( fdc );
-	unlink( FCONSO );
+struct stream {
+	enum kind kind;
+	char *name;		/* FIFO or link to the PTY */
+	int fd;
+	unsigned long int cnt1, cnt2;	/* Indexes */
+} *streams;
+unsigned int nbstreams;
+
+struct frame {	/* Frame being built */
+	char buf[MAXFRAME];
+	size_t len;
+	unsigned int nbgrp;
+	size_t grp[MAXGROUPS];	/* Groups' offset */
+	unsigned char expected[MAXGROUPS];	/* messages per group */
+};
+
+	/* Options */
+unsigned int nbmeters = 0;	/* 0 : legacy single meter */
+int standard = 0, pty = 0;
+double rate = 1, pcorrupt = 0, ptrunc = 0, peot = 0;
+int sinkport = 0;
+unsigned int aliasmax = 65535;	/* topic aliases allowed to MQTT 5 clients */
+const char *watchname = NULL;	/* TeleInfod's pid or command name */
+pid_t watched = 0;
+unsigned int interval = 10, duration = 0;
 
-#ifdef FPROD
-	fclose( fdp );
-	unlink( FPROD );
-#endif
+	/* Figures */
+struct figures {
+	unsigned long frames, groups, bad, trunc, eot;
+	unsigned long cut;	/* valid groups of truncated or interrupted frames */
+	unsigned long overrun;	/* bytes */
+	unsigned long expected;	/* messages */
+	unsigned long received, rbytes;	/* by the sink */
+} tot;
+
+volatile sig_atomic_t stop = 0;
+
+void theend( void ){
+	for(unsigned int i=0; i<nbstreams; i++){
+		if(streams[i].fd >= 0)
+			close( streams[i].fd );
+		unlink( streams[i].name );
+	}
 }
 
 void handleInt(int na){
-	exit(EXIT_SUCCESS);
+	stop = 1;
 }
 
-int main(){
-	unsigned long int cntcp = (unsigned long int)clock(),
-		cntcc = ((unsigned long int)time(NULL) % clock()),
-		cntp = (unsigned long int)time(NULL);
+double chance(double pct){
+	return drand48() * 100 < pct;
+}
 
-		/* Create fifo */
-	mkfifo(FCONSO, 0666);
-#ifdef FPROD
-	mkfifo(FPROD, 0666);
-#endif
-	assert( fdc = fopen(FCONSO, "w") );
-	atexit( theend );
+	/* **
+	 * Frames
+	 * **/
+void group(struct frame *f, const char *label, const char *horodate, const char *val){
+/* Add a group with its checksum
+ * historic : "label SP value SP chk", last space excluded from the checksum
+ * standard : "label HT [horodate HT] value HT chk", last tab included
+ */
+	char sep = standard ? '\t' : ' ';
+	size_t start = f->len;
 
-#ifdef FPROD
-	assert( fdp = fopen(FPROD, "w") );
-#else
-	puts("*W* Prod not enabled");
-#endif
+	assert(f->nbgrp < MAXGROUPS);
+	f->grp[f->nbgrp++] = start;
 
-	signal(SIGINT, handleInt);
+	f->len += sprintf(f->buf + f->len, "\n%s%c", label, sep);
+	if(horodate)
+		f->len += sprintf(f->buf + f->len, "%s%c", horodate, sep);
+	f->len += sprintf(f->buf + f->len, "%s", val);
+
+	unsigned char sum = standard ? sep : 0;
+	for(size_t i = start + 1; i < f->len; i++)
+		sum += (unsigned char)f->buf[i];
+	f->len += sprintf(f->buf + f->len, "%c%c\r", sep, (sum & 0x3f) + 0x20);
+
+	f->expected[f->nbgrp - 1] = (horodate && *val) ? 2 : 1;	/* + '/h' topic */
+	assert(f->len < MAXFRAME - 2);
+}
 
-	for(;;){
-		unsigned long int pap = ((unsigned long int)time(NULL) % clock())/10;
+void historic(struct frame *f, struct stream *s, unsigned int i){
+	char val[32];
+	unsigned long int pap = lrand48() % 6000 + i;
+
+	if(s->kind == K_CONSO){
 		if(pap % 2)
-			cntcp += pap;
+			s->cnt2 += pap;
 		else
-			cntcc += pap;
+			s->cnt1 += pap;
+
+		group(f, "ADCO", NULL, "012345678901");
+		group(f, "OPTARIF", NULL, "HC..");
+		group(f, "ISOUSC", NULL, "60");
+		group(f, "PTEC", NULL, "HP..");
+		group(f, "IMAX", NULL, "062");
+		sprintf(val, "%03ld", pap / 220); group(f, "IINST", NULL, val);
+		sprintf(val, "%05ld", pap); group(f, "PAPP", NULL, val);
+		sprintf(val, "%09ld", s->cnt1); group(f, "HCHC", NULL, val);
+		sprintf(val, "%09ld", s->cnt2); group(f, "HCHP", NULL, val);
+		group(f, "HHPHC", NULL, (pap % 2) ? "P":"C");
+		group(f, "MOTDETAT", NULL, "000000");
+	} else {
+		s->cnt1 += pap;
+
+		group(f, "ADCO", NULL, "987165432101");
+		group(f, "OPTARIF", NULL, "BASE");
+		group(f, "ISOUSC", NULL, "15");
+		sprintf(val, "%09ld", s->cnt1); group(f, "BASE", NULL, val);
+		sprintf(val, "%03ld", pap / 220); group(f, "IINST", NULL, val);
+		sprintf(val, "%05ld", pap); group(f, "PAPP", NULL, val);
+		group(f, "MOTDETAT", NULL, "000000");
+	}
+}
+
+void linky(struct frame *f, struct stream *s, unsigned int i){
+	char val[32], date[64];
+	unsigned long int sin = lrand48() % 9000 + i;
+	unsigned long int sinj = lrand48() % 3000;
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	sprintf(date, "%c%02d%02d%02d%02d%02d%02d", tm.tm_isdst > 0 ? 'E' : 'H',
+		tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+	s->cnt1 += sin / 100;
+	s->cnt2 += sinj / 100;
 
-		unsigned long int pac = ((unsigned long int)time(NULL) % clock())/10;
-		cntp += pac;
+	group(f, "ADSC", NULL, "012345618901");
+	group(f, "VTIC", NULL, "02");
+	group(f, "DATE", date, "");
+	group(f, "NGTF", NULL, "     PRODUCTEUR ");
+	group(f, "LTARF", NULL, "    INDEX NON CONSO ");
+	sprintf(val, "%09ld", s->cnt1); group(f, "EAST", NULL, val);
+	sprintf(val, "%09ld", s->cnt1); group(f, "EASF01", NULL, val);
+	group(f, "EASF02", NULL, "000000000");
+	sprintf(val, "%09ld", s->cnt2); group(f, "EAIT", NULL, val);
+	sprintf(val, "%03ld", sin / 230); group(f, "IRMS1", NULL, val);
+	sprintf(val, "%03ld", 225 + lrand48() % 10); group(f, "URMS1", NULL, val);
+	group(f, "PREF", NULL, "12");
+	group(f, "PCOUP", NULL, "12");
+	sprintf(val, "%05ld", sin); group(f, "SINSTS", NULL, val);
+	sprintf(val, "%05ld", sin); group(f, "SMAXSN", date, val);
+	sprintf(val, "%05ld", sinj); group(f, "SINSTI", NULL, val);
+	sprintf(val, "%05ld", sinj); group(f, "SMAXIN", date, val);
+	sprintf(val, "%03ld", 228 + lrand48() % 5); group(f, "UMOY1", date, val);
+	group(f, "STGE", NULL, "003A0101");
+	group(f, "MSG1", NULL, "PAS DE          MESSAGE         ");
+	group(f, "PRM", NULL, "19528654014760");
+	group(f, "RELAIS", NULL, "000");
+	group(f, "NTARF", NULL, "01");
+	group(f, "NJOURF", NULL, "00");
+	group(f, "NJOURF+1", NULL, "00");
+}
+
+void sendFrame(struct stream *s, unsigned int i){
+	struct frame f;
+	f.len = 0;
+	f.nbgrp = 0;
+
+	if(s->fd < 0){	/* No reader yet (FIFO) */
+		if((s->fd = open(s->name, O_WRONLY | O_NONBLOCK)) == -1)
+			return;
+	}
+
+	f.buf[f.len++] = 0x02;
+	if(s->kind == K_STD)
+		linky(&f, s, i);
+	else
+		historic(&f, s, i);
+	f.buf[f.len++] = 0x03;
+
+		/* Faults' injection */
+	unsigned int cut = f.nbgrp;	/* First group not sent entirely */
+	unsigned long *fault = NULL;	/* the frame doesn't reach ETX */
+	if(chance(ptrunc)){	/* The line is cut in the middle of a group */
+		cut = lrand48() % f.nbgrp;
+		f.len = f.grp[cut] + 3;
+		fault = &tot.trunc;
+	} else if(chance(peot)){	/* The meter interrupts the frame */
+		cut = lrand48() % f.nbgrp;
+		f.len = f.grp[cut];
+		f.buf[f.len++] = 0x04;
+		fault = &tot.eot;
+	}
+
+	unsigned int good = 0, expected = 0, bad = 0;
+	for(unsigned int g=0; g<cut; g++){
+		if(chance(pcorrupt)){	/* a label's character is changed : checksum doesn't match anymore */
+			f.buf[f.grp[g] + 2] ^= 0x01;
+			bad++;
+		} else {
+			good++;
+			expected += f.expected[g];
+		}
+	}
+	ssize_t r = write(s->fd, f.buf, f.len);
+	if(r == (ssize_t)f.len){
+		tot.bad += bad;
+		if(fault){	/* Its values are never published */
+			(*fault)++;
+			tot.cut += good;
+		} else {
+			tot.frames++;
+			tot.groups += good;
+			tot.expected += expected;
+		}
+	} else if(r < 0 && errno == EPIPE && !pty){	/* Reader is gone : waiting for the next one */
+		close(s->fd);
+		s->fd = -1;
+	} else	/* Reader too slow */
+		tot.overrun += f.len - (r < 0 ? 0 : r);
+}
+
+	/* **
+	 * Streams
+	 * **/
+char *fname(const char *dir, const char *base, int idx){
+	char *n = malloc( strlen(dir) + strlen(base) + 13 );
+	assert(n);
+	if(idx < 0)
+		sprintf(n, "%s/%s", dir, base);
+	else
+		sprintf(n, "%s/%s%d", dir, base, idx);
+	return n;
+}
+
+void openStream(struct stream *s){
+/* FIFOs are only opened once their reader is there (see sendFrame()) :
+ * TeleInfod may be waiting for our MQTT sink meanwhile.
+ * Writes never block : a slow reader mustn't slow down others.
+ */
+	if(pty){	/* <name> is a link to the PTY's slave */
+		assert( (s->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) != -1 );
+		assert( !grantpt(s->fd) && !unlockpt(s->fd) );
+		unlink(s->name);
+		if(symlink(ptsname(s->fd), s->name) == -1){
+			perror(s->name);
+			exit(EXIT_FAILURE);
+		}
+	} else if(mkfifo(s->name, 0666) == -1 && errno != EEXIST){
+		perror(s->name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+	/* **
+	 * MQTT sink
+	 *
+	 * Just enough of MQTT 3.1.1 and 5 for a publisher : connection,
+	 * messages acknowledgement (QoS 1 and 2), keep alive.
+	 * **/
+struct client {
+	int fd;
+	int v5;	/* MQTT 5 : acknowledgements have a reason code */
+	size_t len;
+	unsigned char buf[CLIENTBUF];
+} *clients;
+
+void reply(struct client *c, unsigned char type, const unsigned char *id){
+	unsigned char r[4] = { type, 2, 0, 0 };
+	if(id){
+		r[2] = id[0];
+		r[3] = id[1];
+	}
+	if(write(c->fd, r, (type == 0xd0) ? 2 : 4) < 0){
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+size_t packet(struct client *c, unsigned char *p, size_t len){
+/* Handle a packet
+ * <- bytes consumed, 0 if it isn't complete
+ */
+	size_t rlen = 0, hlen = 1;
+	unsigned int shift = 0;
+
+	do {
+		if(hlen >= len)
+			return 0;
+		rlen |= (size_t)(p[hlen] & 0x7f) << shift;
+		shift += 7;
+	} while(p[hlen++] & 0x80);
+
+	if(hlen + rlen > len)
+		return 0;
+
+	unsigned char *b = p + hlen;
+	switch(p[0] >> 4){
+	case 1 :	/* CONNECT */
+		c->v5 = (rlen > 6 && b[6] == 5);
+		{	/* MQTT 5 : Topic Alias Maximum property */
+			unsigned char ack[] = { 0x20, 6, 0, 0, 3, 0x22, aliasmax >> 8, aliasmax & 0xff };
+			if(!c->v5)
+				ack[1] = 2;
+			else if(!aliasmax){
+				ack[1] = 3;
+				ack[4] = 0;
+			}
+			if(write(c->fd, ack, ack[1] + 2) < 0)
+				return len;
+		}
+		break;
+	case 3 :	/* PUBLISH */
+		tot.received++;
+		tot.rbytes += hlen + rlen;	/* as on the wire */
+		if((p[0] >> 1) & 0x03){	/* Packet id follows the topic */
+			unsigned char *id = b + 2 + ((b[0] << 8) | b[1]);
+			reply(c, ((p[0] >> 1) & 0x03) == 1 ? 0x40 : 0x50, id);
+		}
+		break;
+	case 6 :	/* PUBREL */
+		reply(c, 0x70, b);
+		break;
+	case 12 :	/* PINGREQ */
+		reply(c, 0xd0, NULL);
+		break;
+	case 14 :	/* DISCONNECT */
+		close(c->fd);
+		c->fd = -1;
+		break;
+	}
+
+	return hlen + rlen;
+}
+
+void clientData(struct client *c){
+	ssize_t r = read(c->fd, c->buf + c->len, CLIENTBUF - c->len);
+	if(r <= 0){
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += r;
+
+	size_t done = 0, l;
+	while(c->fd != -1 && (l = packet(c, c->buf + done, c->len - done)))
+		done += l;
+
+	if(c->fd == -1)
+		return;
+	if(done == 0 && c->len == CLIENTBUF){	/* Not for us */
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	memmove(c->buf, c->buf + done, c->len - done);
+	c->len -= done;
+}
 
-		fprintf(fdc, "ADCO 012345678901 B\r\nOPTARIF HC.. <\r\nISOUSC 60 <\r\nPTEC HP..  \r\n");
-		fprintf(fdc, "IMAX 062 G\r\nINST %03ld Y\r\nPAPP %05ld +\r\n", pap / 220, pap);
-		fprintf(fdc, "HCHC %09ld Y\r\nHCHP %09ld +\r\nHHPHC %c .\r\n", cntcc, cntcp, (pap % 2)?'P':'C');
-		fprintf(fdc, "MOTDETAT 000000 B\r%c\b\n",3);
+int startSink(int port){
+	struct sockaddr_in a;
+	int one = 1, fd;
 
-		fflush( fdc );
+	assert( (fd = socket(AF_INET, SOCK_STREAM, 0)) != -1 );
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
-#ifdef FPROD
-		fprintf(fdp, "TDETAT 000000 B\r\nADCO 987165432101 B\r\nOPTARIF BASE 0\r\nISOUSC 15 <\r\n");
-		fprintf(fdp, "BASE %09ld ,\r\nIINST %03ld Y\r\nPAPP %05ld +\r\n", cntp, pac / 220, pac);
-		fflush( fdp );
-#endif
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-#ifdef STRESS
-		usleep(STRESS);
-#else
-		sleep(1);
-#endif
+	if(bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1 || listen(fd, MAXCLIENTS) == -1){
+		perror("MQTT sink");
+		exit(EXIT_FAILURE);
 	}
-	return 0;
+
+	assert( (clients = calloc(MAXCLIENTS, sizeof(struct client))) );
+	for(unsigned int i=0; i<MAXCLIENTS; i++)
+		clients[i].fd = -1;
+
+	return fd;
+}
+
+	/* **
+	 * Watched process
+	 * **/
+pid_t findProcess(void){
+/* As TeleInfod has to be launched after us (it needs the sink), it can be
+ * looked for by its name
+ * <- 0 if not running
+ */
+	char *end, path[300], l[64];
+	pid_t pid = strtol(watchname, &end, 10);
+	if(!*end)
+		return pid;
+
+	DIR *d = opendir("/proc");
+	struct dirent *e;
+	pid = 0;
+	while(d && !pid && (e = readdir(d))){
+		strtol(e->d_name, &end, 10);
+		if(*end)
+			continue;
+
+		sprintf(path, "/proc/%s/comm", e->d_name);
+		FILE *f = fopen(path, "r");
+		if(f){
+			if(fgets(l, sizeof(l), f) && !strncmp(l, watchname, strcspn(l, "\n")) && !watchname[strcspn(l, "\n")])
+				pid = atoi(e->d_name);
+			fclose(f);
+		}
+	}
+	if(d)
+		closedir(d);
+	return pid;
+}
+
+int procStat(unsigned long *ticks, unsigned long *rss){
+/* <- 0 if the process is not (or not anymore) running */
+	char path[64], l[256];
+	FILE *f;
+
+	if(!watched && !(watched = findProcess()))
+		return 0;
+
+	sprintf(path, "/proc/%d/stat", (int)watched);
+	if(!(f = fopen(path, "r"))){
+		watched = 0;
+		return 0;
+	}
+	unsigned long ut = 0, st = 0;
+	if(fgets(l, sizeof(l), f)){
+		char *p = strrchr(l, ')');	/* command may contain spaces */
+		if(p)
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st);
+	}
+	fclose(f);
+	*ticks = ut + st;
+
+	sprintf(path, "/proc/%d/status", (int)watched);
+	*rss = 0;
+	if((f = fopen(path, "r"))){
+		while(fgets(l, sizeof(l), f))
+			if(sscanf(l, "VmRSS: %lu", rss) == 1)
+				break;
+		fclose(f);
+	}
+	return 1;
+}
+
+	/* **
+	 * Reports
+	 * **/
+double elapsed(const struct timespec *from, const struct timespec *to){
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+struct sample {
+	struct timespec when;
+	struct figures fig;
+	unsigned long ticks;
+} start, last;
+
+double cpu, cpusum;	/* % */
+unsigned long rss, maxrss;	/* kB */
+unsigned int nbsamples;
+
+void report(int final){
+	struct sample now;
+	clock_gettime(CLOCK_MONOTONIC, &now.when);
+	now.fig = tot;
+	now.ticks = 0;
+
+	double dt = elapsed(&last.when, &now.when);
+	if(dt <= 0)
+		return;
+
+	pid_t prev = watched;
+	if(watchname && procStat(&now.ticks, &rss) && prev == watched){
+		cpu = (now.ticks - last.ticks) * 100.0 / sysconf(_SC_CLK_TCK) / dt;
+		cpusum += cpu;
+		nbsamples++;
+		if(rss > maxrss)
+			maxrss = rss;
+	}
+
+	double dr = tot.expected ? tot.received * 100.0 / tot.expected : 0;
+	if(!final){
+		printf("%6.0fs frames %lu (%.1f/s) groups %lu (%.1f/s) bad %lu trunc %lu eot %lu cut %lu overrun %lu",
+			elapsed(&start.when, &now.when),
+			tot.frames, (tot.frames - last.fig.frames) / dt,
+			tot.groups, (tot.groups - last.fig.groups) / dt,
+			tot.bad, tot.trunc, tot.eot, tot.cut, tot.overrun
+		);
+		if(sinkport)
+			printf(" | received %lu (%.1f/s) delivered %.2f%%", tot.received, (tot.received - last.fig.received) / dt, dr);
+		if(watchname)
+			printf(" | cpu %.1f%% rss %lukB", cpu, rss);
+		putchar('\n');
+	} else {
+		double d = elapsed(&start.when, &now.when);
+		printf("*I* %s %u streams %.0fs : %.1f frames/s %.1f groups/s bad %lu trunc %lu eot %lu cut %lu overrun %lu",
+			standard ? "standard":"historic", nbstreams, d,
+			tot.frames / d, tot.groups / d, tot.bad, tot.trunc, tot.eot, tot.cut, tot.overrun
+		);
+		if(sinkport)
+			printf(" | %.1f msg/s %.1f kB/s %.1f B/msg delivered %.2f%%", tot.received / d, tot.rbytes / d / 1024,
+				tot.received ? (double)tot.rbytes / tot.received : 0, dr);
+		if(watchname && nbsamples)
+			printf(" | cpu avg %.1f%% rss %lukB max %lukB", cpusum / nbsamples, rss, maxrss);
+		putchar('\n');
+	}
+	fflush(stdout);
+
+	last = now;
+}
+
+void printConfig(const char *dir){
+	if(sinkport)
+		printf("Broker_Host=tcp://127.0.0.1:%d\n\n", sinkport);
+
+	for(unsigned int i=0; i<nbstreams; i++){
+		struct stream *s = streams + i;
+		unsigned int m = nbmeters ? i / (standard ? 1 : 2) : 0;
+
+		switch(s->kind){
+		case K_CONSO:
+			printf("*Conso%u\nPort=%s\nTopic=TeleInfo/Conso%u/values\nPublish=*\n\n", m, s->name, m);
+			break;
+		case K_PROD:
+			printf("*Prod%u\nPort=%s\nTopic=TeleInfo/Prod%u/values\nPublish=*\n\n", m, s->name, m);
+			break;
+		case K_STD:
+			printf("*Linky%u\nSPort=%s\nTopic=TeleInfo/Linky%u/values\nPublish=*\n\n", m, s->name, m);
+			break;
+		}
+	}
+}
+
+int main(int ac, char **av){
+	const char *dir = "/tmp";
+	int conf = 0, opt;
+
+	while((opt = getopt(ac, av, "n:d:spr:C:T:E:b:A:P:i:D:ch")) != -1){
+		switch(opt){
+		case 'n':
+			nbmeters = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			standard = 1;
+			break;
+		case 'p':
+			pty = 1;
+			break;
+		case 'r':
+			if((rate = atof(optarg)) <= 0){
+				fputs("*F* rate must be positive\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			pcorrupt = atof(optarg);
+			break;
+		case 'T':
+			ptrunc = atof(optarg);
+			break;
+		case 'E':
+			peot = atof(optarg);
+			break;
+		case 'b':
+			sinkport = atoi(optarg);
+			break;
+		case 'A':
+			if((aliasmax = atoi(optarg)) > 65535)
+				aliasmax = 65535;
+			break;
+		case 'P':
+			watchname = optarg;
+			break;
+		case 'i':
+			if(!(interval = atoi(optarg)))
+				interval = 1;
+			break;
+		case 'D':
+			duration = atoi(optarg);
+			break;
+		case 'c':
+			conf = 1;
+			break;
+		default:
+			fprintf(stderr, "%s [-n meters] [-d directory] [-s] [-p] [-r rate] [-C %%] [-T %%] [-E %%] [-b port] [-A aliases] [-P pid|name] [-i interval] [-D duration] [-c]\n", av[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unsigned int nb = nbmeters ? nbmeters:1;
+	nbstreams = standard ? nb : 2*nb;
+	assert( (streams = calloc(nbstreams, sizeof(struct stream))) );
+
+	srand48(time(NULL) ^ getpid());
+	for(unsigned int i=0; i<nb; i++){
+		int idx = nbmeters ? (int)i:-1;
+
+		if(standard){
+			struct stream *s = streams + i;
+			s->kind = K_STD;
+			s->name = fname(dir, FSTD, idx);
+		} else {
+			struct stream *s = streams + 2*i;
+			s->kind = K_CONSO;
+			s->name = fname(dir, FCONSO, idx);
+			s->cnt1 = lrand48() % 100000000;
+			s->cnt2 = lrand48() % 100000000;
+
+			s++;
+			s->kind = K_PROD;
+			s->name = fname(dir, FPROD, idx);
+			s->cnt1 = lrand48() % 100000000;
+		}
+	}
+
+	if(conf){	/* TeleInfod's configuration for these streams */
+		printConfig(dir);
+		exit(EXIT_SUCCESS);
+	}
+
+	for(unsigned int i=0; i<nbstreams; i++)
+		streams[i].fd = -1;
+	atexit( theend );
+
+	signal(SIGINT, handleInt);
+	signal(SIGTERM, handleInt);
+	signal(SIGPIPE, SIG_IGN);
+
+		/* The sink has to run before TeleInfod connects */
+	int lfd = sinkport ? startSink(sinkport) : -1;
+
+	for(unsigned int i=0; i<nbstreams; i++)
+		openStream(streams + i);
+	printf("*I* %u %s ready\n", nbstreams, pty ? "PTYs" : "FIFOs");
+	fflush(stdout);
+
+	struct pollfd pfd[MAXCLIENTS + 1];
+	struct timespec next, now, end;
+	long period = 1e9 / rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &start.when);
+	if(watchname)
+		procStat(&start.ticks, &rss);
+	last = start;
+	next = start.when;
+	end = start.when;
+	end.tv_sec += duration;
+	time_t nextreport = start.when.tv_sec + interval;
+
+	while(!stop){
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if(elapsed(&next, &now) >= 0){	/* Time for new frames */
+			for(unsigned int i=0; i<nbstreams; i++)
+				sendFrame(streams + i, nbmeters ? i:0);
+
+			next.tv_nsec += period;
+			next.tv_sec += next.tv_nsec / 1000000000;
+			next.tv_nsec %= 1000000000;
+			if(elapsed(&next, &now) > 1)	/* Can't keep up : don't burst */
+				next = now;
+			continue;
+		}
+
+		if(now.tv_sec >= nextreport){
+			report(0);
+			nextreport += interval;
+		}
+		if(duration && elapsed(&end, &now) >= 0)
+			break;
+
+			/* Wait for the next frame, serving the sink meanwhile */
+		unsigned int nfd = 0;
+		if(lfd != -1){
+			pfd[nfd].fd = lfd;
+			pfd[nfd++].events = POLLIN;
+			for(unsigned int i=0; i<MAXCLIENTS; i++){
+				pfd[nfd].fd = clients[i].fd;	/* negative ones are ignored */
+				pfd[nfd++].events = POLLIN;
+			}
+		}
+
+		double w = -elapsed(&next, &now);
+		struct timespec to = { (time_t)w, (long)((w - (time_t)w) * 1e9) };
+		if(ppoll(pfd, nfd, &to, NULL) <= 0)
+			continue;
+
+		if(pfd[0].revents & POLLIN){
+			int fd = accept(lfd, NULL, NULL);
+			if(fd != -1){
+				unsigned int i;
+				for(i=0; i<MAXCLIENTS && clients[i].fd != -1; i++);
+				if(i < MAXCLIENTS){
+					clients[i].fd = fd;
+					clients[i].len = 0;
+				} else
+					close(fd);
+			}
+		}
+		for(unsigned int i=0; i<MAXCLIENTS; i++)
+			if(clients[i].fd != -1 && pfd[i+1].revents)
+				clientData(clients + i);
+	}
+
+	report(1);
+	exit(EXIT_SUCCESS);
 }
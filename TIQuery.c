@@ -0,0 +1,173 @@
+/*
+ * TIQuery
+ * 	Read TeleInfod's local time series (Store= directive).
+ *
+ *	Without -l, segments and their labels are listed. Otherwise, samples
+ *	of this label within the time range are printed, one per line :
+ *		<epoch>	<value>
+ *	Dates are given as epoch or as "YYYY-MM-DD[ hh:mm[:ss]]" (local time).
+ *
+ * Compilation :
+make query
+ * Usage :
+./TeleInfod_query -s store [-l label] [-f from] [-t to] [-H]
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "src/TeleInfod.h"
+#include "src/Config.h"
+
+static int64_t parseDate(const char *arg){
+	const char *fmts[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL };
+	struct tm tm;
+	char *end;
+
+	long long v = strtoll(arg, &end, 10);
+	if(!*end)
+		return v;
+
+	for(const char **f = fmts; *f; f++){
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(arg, *f, &tm);
+		if(end && !*end){
+			tm.tm_isdst = -1;
+			return mktime(&tm);
+		}
+	}
+
+	fprintf(stderr, "*F* '%s' : invalid date\n", arg);
+	exit(EXIT_FAILURE);
+}
+
+static void printDate(int64_t t, bool human){
+	if(human){
+		char buf[32];
+		time_t tt = t;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&tt));
+		fputs(buf, stdout);
+	} else
+		printf("%lld", (long long)t);
+}
+
+static int segments(const char *store, struct dirent ***lst){
+	int nb = scandir(store, lst, NULL, alphasort);
+	if(nb < 0){
+		perror(store);
+		exit(EXIT_FAILURE);
+	}
+	return nb;
+}
+
+int main(int ac, char **av){
+	const char *store = NULL, *label = NULL;
+	int64_t from = INT64_MIN, to = INT64_MAX;
+	bool human = false;
+	int opt;
+
+	while((opt = getopt(ac, av, "s:l:f:t:Hh")) != -1){
+		switch(opt){
+		case 's':
+			store = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'f':
+			from = parseDate(optarg);
+			break;
+		case 't':
+			to = parseDate(optarg);
+			break;
+		case 'H':
+			human = true;
+			break;
+		default:
+			fprintf(stderr, "%s -s store [-l label] [-f from] [-t to] [-H]\n", av[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(!store){
+		fputs("*F* -s is mandatory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	struct dirent **lst;
+	int nb = segments(store, &lst);
+
+	for(int i=0; i<nb; i++){
+		if(*lst[i]->d_name == '.')
+			continue;
+
+		char *end;
+		int64_t seg = strtoll(lst[i]->d_name, &end, 10);
+		if(*end || seg > to)
+			continue;
+
+		char path[strlen(store) + 2*NAME_MAX + 3];
+		struct ColumnReader rd;
+		int64_t t;
+		uint64_t v;
+
+		if(!label){	/* List the content of this segment */
+			struct dirent **cols;
+			sprintf(path, "%s/%s", store, lst[i]->d_name);
+			int nbc = segments(path, &cols);
+
+			printDate(seg, human);
+			puts(" :");
+			for(int j=0; j<nbc; j++){
+				sprintf(path, "%s/%s/%s", store, lst[i]->d_name, cols[j]->d_name);
+				if(*cols[j]->d_name != '.' && openColumnReader(&rd, path)){
+					printf("\t%-10s %8lu samples, %6lu bytes, ", cols[j]->d_name, (unsigned long)rd.hdr->count, (unsigned long)(rd.hdr->bits + 7) / 8);
+					printDate(rd.hdr->firstt, human);
+					fputs(" - ", stdout);
+					printDate(rd.hdr->lastt, human);
+					putchar('\n');
+					closeColumnReader(&rd);
+				}
+				free(cols[j]);
+			}
+			free(cols);
+			continue;
+		}
+
+		sprintf(path, "%s/%s/%s", store, lst[i]->d_name, label);
+		if(!openColumnReader(&rd, path))
+			continue;
+
+		if(rd.hdr->lastt >= from)
+			while(columnNext(&rd, &t, &v)){
+				if(t < from)
+					continue;
+				if(t > to)
+					break;
+				printDate(t, human);
+				printf("\t%llu\n", (unsigned long long)v);
+			}
+
+		closeColumnReader(&rd);
+	}
+
+	exit(EXIT_SUCCESS);
+}
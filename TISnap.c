@@ -0,0 +1,149 @@
+/*
+ * TISnap
+ * 	Read a TeleInfod's shared memory snapshot (Snapshot= directive).
+ *
+ *	Without label, all fields of the latest frame are printed, otherwise
+ *	only given ones :
+ *		<label>	<value>	[<horodate>]	<age>s
+ *	-w prints them again at every new frame, -b measures how long a
+ *	consistent read of these labels takes.
+ *
+ * Compilation :
+make snap
+ * Usage :
+./TeleInfod_snap -s name [-w] [-b] [label ...]
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "src/Snapshot.h"
+
+#define BENCH_LOOPS 1000000
+
+static void printField(const struct TISnapField *f, time_t now){
+	printf("%-10s %s", f->label, f->text);
+	if(f->stamp){
+		char buf[32];
+		time_t t = f->stamp;
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("\t(%s)", buf);
+	}
+	printf("\t%llds\n", (long long)(now - f->received));
+}
+
+static void printFrame(const struct TISnapshot *s, char **labels, int nb){
+	static struct TISnapshot copy;	/* too large for the stack */
+	struct TISnapField f;
+	time_t now = time(NULL);
+
+	if(!nb){
+		tisnapCopy(s, &copy);
+		printf("[%s] frame %llu\n", copy.section, (unsigned long long)copy.frames);
+		for(unsigned int i=0; i<copy.nbfields && i<TISNAP_FIELDS; i++)
+			if(copy.fields[i].received)
+				printField(copy.fields + i, now);
+	} else
+		for(int i=0; i<nb; i++){
+			if(tisnapValue(s, labels[i], &f))
+				printField(&f, now);
+			else
+				printf("%-10s not received\n", labels[i]);
+		}
+	fflush(stdout);
+}
+
+static void bench(const struct TISnapshot *s, char **labels, int nb){
+	struct timespec start, end;
+	struct TISnapField f;
+	int idx[nb];
+
+	for(int i=0; i<nb; i++)
+		if((idx[i] = tisnapFind(s, labels[i])) < 0){
+			fprintf(stderr, "*F* '%s' isn't published\n", labels[i]);
+			exit(EXIT_FAILURE);
+		}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(unsigned int l=0; l<BENCH_LOOPS; l++)
+		for(int i=0; i<nb; i++)
+			tisnapGet(s, idx[i], &f);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_LOOPS;
+	printf("%d label(s) read in %.1f ns (%.1f ns per label)\n", nb, ns, ns / nb);
+}
+
+int main(int ac, char **av){
+	const char *name = NULL;
+	bool watch = false, measure = false;
+	int opt;
+
+	while((opt = getopt(ac, av, "s:wbh")) != -1){
+		switch(opt){
+		case 's':
+			name = optarg;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 'b':
+			measure = true;
+			break;
+		default:
+			fprintf(stderr, "%s -s name [-w] [-b] [label ...]\n", av[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(!name){
+		fputs("*F* -s is mandatory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	const struct TISnapshot *s = tisnapOpen(name);
+	if(!s){
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	char **labels = av + optind;
+	int nb = ac - optind;
+
+	if(measure){
+		if(!nb){
+			fputs("*F* -b needs labels\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		bench(s, labels, nb);
+	} else if(watch){
+		uint64_t last = ~0;
+		for(;;){
+			uint32_t seq = tisnapBegin(s);
+			uint64_t frames = s->frames;
+			if(!tisnapRetry(s, seq) && frames != last){
+				last = frames;
+				printFrame(s, labels, nb);
+			}
+			usleep(100000);
+		}
+	} else
+		printFrame(s, labels, nb);
+
+	tisnapClose(s);
+	exit(EXIT_SUCCESS);
+}
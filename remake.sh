@@ -6,22 +6,41 @@
 # Select which mqtt stack to use
 # if set, use PAHO library, otherwise use Mosquitto's
 USE_PAHO=1
+# if set as well, use PAHO's asynchronous flavour (in-flight window)
+#USE_PAHO_ASYNC=1
+
+# if set, measure latencies between reception and publishing
+#LATENCY_STATS=1
+
+# if set, everything is allocated at startup and threads' stacks are small
+#SMALL_FOOTPRINT=1
 
 # end of customisation area
 
 # Error is fatal
 set -e
 
-if [ ${USE_PAHO+x} ]; then
+if [ ${USE_PAHO_ASYNC+x} ]; then
+	FLAGS='-DUSE_PAHO_ASYNC'
+	LIBS='-lpaho-mqtt3a'
+elif [ ${USE_PAHO+x} ]; then
 	FLAGS='-DUSE_PAHO'
 	LIBS='-lpaho-mqtt3c'
 else	# Use Mosquitto one
-	FLAGS=''
+	FLAGS='-DUSE_MOSQUITTO'
 	LIBS='-lmosquitto'
 fi
 
+if [ ${LATENCY_STATS+x} ]; then
+	FLAGS="$FLAGS -DLATENCY_STATS"
+fi
+
+if [ ${SMALL_FOOTPRINT+x} ]; then
+	FLAGS="$FLAGS -DSMALL_FOOTPRINT"
+fi
+
 FLAGS="$FLAGS -Wall"
-LIBS="-lpthread $LIBS"
+LIBS="-lpthread -lrt $LIBS"
 
 cd src
 LFMakeMaker -v +f=Makefile --opts="$FLAGS $LIBS" *.c -t=../TeleInfod > Makefile
@@ -0,0 +1,176 @@
+/*
+ *	Alias.c
+ *		MQTT 5 topic aliases
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * With Broker_Version=5, each topic gets a 2 bytes alias the first time
+ * it is published. The first message of a topic on a connection carries
+ * both the topic and its alias, next ones only the alias : a value is
+ * often shorter than its topic.
+ *
+ * Aliases only live as long as the connection : every (re)connection
+ * starts a new generation, so each topic is announced again. So does a
+ * failed publication, as it may have been an announce. Numbers don't
+ * change, but only those within broker's Topic Alias Maximum (from its
+ * CONNACK) are used.
+ * Once the connection is lost, none is used until the next one is
+ * established (aliasesConnected()) : an alias announced on the previous
+ * connection is never sent alone on a new one.
+ *
+ * The table is used by the publisher's thread and by MQTT sinks' ones
+ * (see Sink.c), under a lock ; a topic is only published by one of them,
+ * so its announce is always sent before it is used alone. Topics are
+ * copied in a pool allocated at startup ; once it is full, new topics
+ * are published without alias.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+struct Alias {
+	const char *topic;	/* NULL : free entry */
+	uint32_t hash;
+	uint16_t alias;
+	unsigned int gen;	/* generation it has been announced in */
+};
+
+static struct Alias *table;
+static unsigned int mask;		/* table's size - 1 */
+static unsigned int maxaliases, nbaliases;
+static char *pool;
+static size_t poolsz, poolused;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	/* table and pool */
+
+static atomic_uint limit;		/* usable aliases on this connection */
+static atomic_uint brokerlimit;	/* broker's Topic Alias Maximum */
+static atomic_uint generation;	/* bumped at each connection */
+
+static uint32_t hash(const char *s){
+/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for(; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+void initAliases(unsigned int max){
+/* -> max : number of aliases TeleInfod may assign */
+	unsigned int sz = 16;
+
+	if(max > UINT16_MAX)
+		max = UINT16_MAX;
+	maxaliases = max;
+	if(!max)
+		return;
+
+	while(sz < 2 * max)	/* never more than half full */
+		sz <<= 1;
+	mask = sz - 1;
+
+	assert( (table = cfgCalloc(sz, sizeof(struct Alias))) );
+	poolsz = max * ALIAS_TOPIC;
+	assert( (pool = cfgAlloc(poolsz)) );
+
+	atomic_init(&generation, 1);	/* 0 : never announced */
+	atomic_init(&limit, 0);			/* until the broker tells */
+	atomic_init(&brokerlimit, 0);
+}
+
+void aliasesForget(void){
+/* A message announcing an alias may not have reached the broker :
+ * all of them will be announced again
+ */
+	atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+}
+
+void aliasesConnected(int brokermax){
+/* A connection is established : aliases have to be announced again
+ * -> brokermax : broker's Topic Alias Maximum, -1 if it isn't known
+ * 	(automatic reconnection to the same broker)
+ */
+	if(!maxaliases)
+		return;
+
+	if(brokermax >= 0)
+		atomic_store(&brokerlimit, (unsigned int)brokermax < maxaliases ? (unsigned int)brokermax : maxaliases);
+	aliasesForget();
+	atomic_store(&limit, atomic_load(&brokerlimit));
+
+	if(debug)
+		printf("*I* Up to %u topic aliases used on this connection\n", atomic_load(&limit));
+}
+
+void aliasesDisconnected(void){
+/* The connection is lost : no alias until the next one */
+	if(!maxaliases)
+		return;
+
+	atomic_store(&limit, 0);
+	aliasesForget();
+}
+
+unsigned int topicAlias(const char *topic, bool *bare){
+/* Publishing threads
+ * <- topic's alias, 0 if it has none
+ * 	bare : the broker already knows it, the topic can be omitted
+ */
+	unsigned int lim = atomic_load_explicit(&limit, memory_order_relaxed);
+	unsigned int alias = 0;
+	struct Alias *e;
+
+	*bare = false;
+	if(!lim)
+		return 0;
+
+	uint32_t h = hash(topic);
+	pthread_mutex_lock(&lock);
+	for(unsigned int i = h & mask;; i = (i + 1) & mask){
+		e = table + i;
+
+		if(!e->topic){	/* Not known yet */
+			size_t len = strlen(topic) + 1;
+			if(nbaliases >= maxaliases || poolused + len > poolsz)
+				goto done;
+
+			e->topic = memcpy(pool + poolused, topic, len);
+			poolused += len;
+			e->hash = h;
+			e->alias = ++nbaliases;
+			e->gen = 0;
+			break;
+		}
+
+		if(e->hash == h && !strcmp(e->topic, topic))
+			break;
+	}
+
+	if(e->alias > lim)	/* Beyond what this broker accepts */
+		goto done;
+
+	unsigned int g = atomic_load_explicit(&generation, memory_order_acquire);
+	if(e->gen == g){
+		*bare = true;
+		atomic_fetch_add_explicit(&brokerstats.aliased, 1, memory_order_relaxed);
+	} else
+		e->gen = g;
+	alias = e->alias;
+
+done:
+	pthread_mutex_unlock(&lock);
+	return alias;
+}
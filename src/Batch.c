@@ -0,0 +1,224 @@
+/*
+ *	Batch.c
+ *		Publish a whole frame as a single message
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * When FrameTopic= is set, groups published between STX and ETX are
+ * collected in a JSON object keyed by label :
+ * 	{"EAST":802,"NGTF":"   PRODUCTEUR   ","SMAXSN":{"value":8,"date":"E241011000639","ts":1728597999}}
+ * which is published on this topic when the frame is over ("ts" is the
+ * horodate as epoch seconds).
+ * Frames without STX or ETX (partial ones) are discarded.
+ *
+ * With Encoding=cbor or msgpack, the frame is a map of the same keys ;
+ * a value with an horodate is a [value, timestamp] array.
+ *
+ * When KeyFrame=<n> is set, only labels that changed since the previous
+ * frame are sent, and all of them every <n> frames. A "key" entry tells
+ * which kind of frame it is :
+ * 	{"key":false,"SINSTS":14}
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static void addRaw(struct CSection *s, const char *v, size_t len){
+	if(s->batchlen + len < FRAMEBATCH_SZ)
+		memcpy(s->batch + s->batchlen, v, len);
+	s->batchlen += len;	/* On overflow, only the length is kept */
+}
+
+static void addString(struct CSection *s, const char *v, size_t len){
+	static const char hex[] = "0123456789abcdef";
+
+	if(s->encoding != ENC_TEXT){
+		char buf[len + 5];
+		addRaw(s, buf, encodeText(s->encoding, buf, v, len));
+		return;
+	}
+
+	addRaw(s, "\"", 1);
+	for(size_t i=0; i<len; i++){
+		unsigned char c = v[i];
+		if(c == '"' || c == '\\'){
+			char e[2] = { '\\', c };
+			addRaw(s, e, 2);
+		} else if(c < 0x20){
+			char e[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0f] };
+			addRaw(s, e, 6);
+		} else
+			addRaw(s, v+i, 1);
+	}
+	addRaw(s, "\"", 1);
+}
+
+static void addKey(struct CSection *s, const char *key){
+	if(s->encoding == ENC_TEXT && s->batchnb++)
+		addRaw(s, ",", 1);
+	else if(s->encoding != ENC_TEXT)
+		s->batchnb++;
+	addString(s, key, strlen(key));
+	if(s->encoding == ENC_TEXT)
+		addRaw(s, ":", 1);
+}
+
+void initBatch(struct CSection *s){
+	if(!s->frametopic)
+		return;
+
+	assert( (s->batch = cfgAlloc(FRAMEBATCH_SZ)) );
+	s->batchlen = 0;
+	s->inframe = false;
+	s->nbbatch = 0;
+}
+
+void batchStart(struct CSection *s){
+	if(!s->frametopic)
+		return;
+
+	if(s->inframe && debug)
+		printf("*d* [%s] Frame without ETX ... ignored\n", s->name);
+
+	switch(s->encoding){
+	case ENC_CBOR :
+		s->batch[0] = 0xbf;	/* indefinite length map */
+		s->batchlen = 1;
+		break;
+	case ENC_MSGPACK :
+		s->batch[0] = 0xde;	/* map 16, its size is set at the end */
+		s->batchlen = 3;
+		break;
+	default :
+		s->batch[0] = '{';
+		s->batchlen = 1;
+	}
+	s->batchnb = 0;
+	s->inframe = true;
+
+	s->keyframe = !s->keyframes || !(s->nbbatch % s->keyframes);
+	if(s->keyframes){	/* Tell which kind of frame it is */
+		addKey(s, "key");
+		if(s->encoding == ENC_TEXT)
+			addRaw(s, s->keyframe ? "true":"false", s->keyframe ? 4:5);
+		else if(s->encoding == ENC_CBOR)
+			addRaw(s, s->keyframe ? "\xf5":"\xf4", 1);
+		else
+			addRaw(s, s->keyframe ? "\xc3":"\xc2", 1);
+	}
+}
+
+void batchAdd(struct CSection *s, struct PubLabel *pl, const char *hd){
+/* Add label's value to the current frame
+ * -> hd : horodate as received (may be NULL)
+ */
+	if(!s->frametopic || !s->inframe)
+		return;
+
+	const struct TIValue *v = &pl->value;
+
+	if(s->keyframes){	/* Delta frames : only what changed */
+		uint64_t h = (v->valid ? v->num : hashText(v->text)) ^ (uint64_t)v->stamp;
+		bool same = pl->inbatch && h == pl->batchhash;
+
+		pl->inbatch = true;
+		pl->batchhash = h;
+		if(same && !s->keyframe)
+			return;
+	}
+
+	addKey(s, pl->name);
+
+	if(s->encoding != ENC_TEXT){
+		char buf[VALUE_MAX + 16];
+
+		if(hd){
+			addRaw(s, buf, encodeArray(s->encoding, buf, 2));
+			addRaw(s, buf, encodeValue(s->encoding, buf, pl));
+			if(v->stamp)
+				addRaw(s, buf, encodeStamp(s->encoding, buf, v->stamp));
+			else	/* Invalid horodate : kept as is */
+				addString(s, hd, strlen(hd));
+		} else
+			addRaw(s, buf, encodeValue(s->encoding, buf, pl));
+		return;
+	}
+
+	char buf[24];
+
+	if(hd)
+		addRaw(s, "{\"value\":", 9);
+	if(v->valid && !(pl->flags & LF_RAW))
+		addRaw(s, v->text, v->len);
+	else
+		addString(s, v->text, v->len);
+	if(hd){
+		addRaw(s, ",\"date\":", 8);
+		addString(s, hd, strlen(hd));
+		if(v->stamp)
+			addRaw(s, buf, sprintf(buf, ",\"ts\":%lld", (long long)v->stamp));
+		addRaw(s, "}", 1);
+	}
+}
+
+void batchAbort(struct CSection *s){
+/* The frame has been interrupted : nothing has been collected yet as
+ * values are only added once the frame is complete (see Decode.c)
+ */
+	if(!s->frametopic || !s->inframe)
+		return;
+	s->inframe = false;
+
+	if(debug)
+		printf("*d* [%s] Interrupted frame not published\n", s->name);
+}
+
+void batchPublish(struct CSection *s){
+/* The frame is over : publish it */
+	if(!s->frametopic || !s->inframe)
+		return;
+	s->inframe = false;
+	s->nbbatch++;
+
+	if(s->batchnb == (s->keyframes ? 1:0))	/* Nothing to publish */
+		return;
+
+	switch(s->encoding){
+	case ENC_CBOR :
+		addRaw(s, "\xff", 1);	/* break */
+		break;
+	case ENC_MSGPACK :
+		s->batch[1] = s->batchnb >> 8;
+		s->batch[2] = s->batchnb;
+		break;
+	default :
+		addRaw(s, "}", 1);
+	}
+
+	if(s->batchlen >= FRAMEBATCH_SZ){
+		fprintf(stderr, "*E* [%s] Frame too large to be published (%lu bytes)\n", s->name, (unsigned long)s->batchlen);
+		return;
+	}
+
+	if(debug){
+		if(s->encoding == ENC_TEXT)
+			printf("*d* [%s] Publishing frame '%s' : '%.*s'\n", s->name, s->frametopic, (int)s->batchlen, s->batch);
+		else
+			printf("*d* [%s] Publishing frame '%s' : %lu bytes\n", s->name, s->frametopic, (unsigned long)s->batchlen);
+	}
+	qpublish(s, s->frametopic, strlen(s->frametopic), s->batchlen, s->batch, 0);
+}
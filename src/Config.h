@@ -19,19 +19,254 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "TeleInfod.h"
+
+	/* Labels to publish */
+#define LABELS_HASHSZ	256	/* Slots in the lookup table (power of 2) */
+#define LABELS_MAX	127		/* Keep the table at most half full */
+
+#define LF_RAW	1			/* Non numeric value */
+#define LF_PTEC	2			/* Converted to historic PTEC */
+#define LF_OWNED	4		/* Name allocated by compileLabels() */
+
+	/* Decoded values (see Decode.c) */
+#define VALUE_MAX	100		/* Longest value (PJOURF+1) */
+
+enum ValueType {
+	VT_STRING = 0,	/* Kept as received */
+	VT_U32,			/* Numeric */
+	VT_U64,			/* Energy counters */
+	VT_ENUM,		/* Tariff period (NTARF, PTEC) */
+	VT_BITS,		/* Hexadecimal status register (STGE) */
+	VT_DATE			/* Horodate only (DATE) */
+};
+
+struct TIValue {	/* Last value received for a label */
+	bool valid;			/* Decoded (otherwise only text is meaningful) */
+	uint64_t num;		/* U32, U64, ENUM, BITS ; epoch of a DATE */
+	int64_t stamp;		/* Horodate as epoch seconds, 0 if none */
+	time_t received;
+	unsigned char len;
+	char text[VALUE_MAX+1];	/* As to be published (numbers without leading 0) */
+};
+
+struct TopicName {	/* Prebuilt topic */
+	char *name;		/* NULL : not published there */
+	size_t len;
+};
+
+struct PubLabel {
+	const char *name;
+	unsigned int flags;
+	enum ValueType type;
+	struct TIValue value;	/* Section's snapshot */
+	atomic_uint seq;		/* ... odd while being updated */
+
+		/* Frame being received (see Decode.c) */
+	struct TIValue pending;	/* applied once the frame is complete */
+	char hd[VALUE_MAX+1];	/* its horodate as received */
+	unsigned char hlen;
+	bool dated;				/* ... if any */
+	bool staged;			/* pending for this frame */
+	struct PubLabel *nextstaged;	/* ... in reception order */
+
+		/* Where to publish (built once the section is checked) */
+	struct TopicName topic;		/* Topic= */
+	struct TopicName htopic;	/* Its horodate (standard only) */
+	struct TopicName cptopic;	/* ConvProd= */
+	struct TopicName cctopic;	/* ConvCons= */
+
+		/* Publish on change */
+	unsigned long deadband;	/* numeric change to be ignored */
+	bool published;			/* the cache is filled */
+	time_t lastpub;			/* when it has been published */
+	uint64_t lasthash;		/* hash of the value published */
+	int64_t laststamp;		/* its horodate (0 if none) */
+	uint64_t lastval;		/* last numeric value published */
+
+	struct Column *col;		/* Local storage (NULL if none) */
+
+		/* Delta frames */
+	bool inbatch;			/* sent in a previous frame */
+	uint64_t batchhash;		/* what has been sent */
+};
+
+struct LabelSet {	/* Compiled Publish= */
+	struct PubLabel *labels;
+	unsigned int nb;
+	unsigned char slot[LABELS_HASHSZ];	/* index in labels + 1, 0 : empty */
+};
+
+	/* A message waiting to be published, followed by its topic
+	 * (including the '\0') and its payload */
+struct QRecord {
+	uint16_t tlen;		/* topic's length (0 : padding up to the end of the ring) */
+	uint16_t plen;		/* payload's length */
+	uint32_t retained:8;
+	uint32_t age:24;	/* µs between reception and queueing (LATENCY_STATS only) */
+	int64_t stamp;		/* queueing time (µs since epoch) */
+};
+
+#define QALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+	/* Messages waiting to be published */
+struct PubQueue {
+	char *ring;
+	size_t size;			/* power of 2 */
+	atomic_size_t head;		/* written by the reader */
+	atomic_size_t tail;		/* written by the publisher */
+	atomic_ulong dropped;	/* messages lost as the queue was full */
+	atomic_ulong published;
+	atomic_ullong latency;	/* sum of published messages' delays (µs) */
+};
+
+#ifdef LATENCY_STATS
+	/* Log-linear histogram of durations (µs), HDR style :
+	 * 2^LATENCY_SUBBITS buckets per power of 2, up to 2^32 µs */
+#define LATENCY_SUBBITS	3
+#define LATENCY_BUCKETS	((32 - LATENCY_SUBBITS + 1) << LATENCY_SUBBITS)
+
+struct Histogram {	/* Only one thread records in a given histogram */
+	atomic_ulong count[LATENCY_BUCKETS];
+};
+#endif
+
+	/* Local time series (see Store.c) */
+#define CODEC_DOD	0	/* Delta of delta (counters) */
+#define CODEC_XOR	1	/* XOR with the previous value */
+
+struct ColumnHeader {	/* On disk, followed by the bit stream */
+	char magic[8];
+	uint8_t codec;
+	uint8_t leading, trailing;	/* XOR window (leading 0xff : none yet) */
+	uint8_t filler[5];
+	uint64_t count;		/* samples */
+	uint64_t bits;		/* bit stream's length */
+	int64_t firstt, lastt, lastdt;
+	uint64_t firstv, lastv;
+	int64_t lastdv;
+};
+
+struct Column {	/* A label in the current segment */
+	struct ColumnHeader *hdr;	/* mapped file, NULL if not opened */
+	size_t mapped;
+	int fd;
+	int64_t seg;		/* segment's start */
+};
+
+struct ColumnReader {
+	const struct ColumnHeader *hdr;
+	size_t size;
+	const unsigned char *data;
+	uint64_t pos;		/* in bits */
+	uint64_t idx;		/* sample */
+	int64_t t, dt, dv;
+	uint64_t v;
+	unsigned int leading, trailing;
+};
+
+	/* Additional outputs (see Sink.c) */
+struct Sink {
+	struct Sink *next;
+	const char *target;		/* as configured (kind:address) */
+	const struct SinkOps *ops;	/* its kind (see Sink.c) */
+	const char *measurement;
+	size_t queuesz;			/* 0 : Queue_Size= */
+	size_t batch;			/* largest write (bytes) */
+	unsigned int linger;	/* ms a line may wait for others */
+
+		/* Running (sink's own thread) */
+	struct PubQueue queue;	/* lines waiting to be sent */
+	sem_t pending;
+	char *prefix;			/* "<measurement>,section=<name> " */
+	size_t prefixlen;
+	bool up;				/* opened, lines can be sent */
+	bool failing;			/* a failure has been reported */
+	int fd;					/* socket's, -1 if none */
+	char *buf;				/* batch being built */
+	size_t buflen;
+	unsigned int buflines;
+	atomic_ulong writes;	/* datagrams / writes sent */
+	atomic_ulong lost;		/* lines lost by failed writes */
+};
+
+	/* Messages waiting for the broker */
+struct SpoolHeader;
+struct Spool {
+	struct SpoolHeader *hdr;	/* mapped file */
+	char *data;
+	unsigned long lost;		/* overwritten as the spool was full */
+};
 
 struct CSection {	/* Section of the configuration : a TéléInfo flow */
 	struct CSection *next;	/* Next section */
 	const char *name;		/* help to have understandable error messages */
 	pthread_t thread;
 	const char *port;		/* Where to read */
+	unsigned int baud;		/* Serial port setup (if a tty) */
+	unsigned char databits, stopbits;
+	char parity;			/* 'N', 'E' or 'O' */
+	bool lowlatency;		/* read policy */
+	unsigned char vmin, vtime;
 	const char *labels;		/* Label to publish */
+	struct LabelSet *_Atomic pub;	/* ... compiled */
 	bool standard;			/* true : standard frames, false : historic */
 	const char *topic;		/* main topic */
 	const char *cctopic;	/* Converted Customer topic */
 	const char *cptopic;	/* Converted Producer topic */
+	unsigned int refresh;	/* Publish on change : republish after (seconds) */
+	const char *deadbands;	/* Numeric deadbands (LABEL:delta,...) */
+	const char *frametopic;	/* Whole frame topic */
+	enum Encoding encoding;	/* Payloads' format */
+	unsigned int keyframes;	/* Delta frames : full frame every ... (0 : always full) */
+
+		/* Frame being collected (if frametopic) */
+	char *batch;
+	size_t batchlen;
+	unsigned int batchnb;	/* entries in the frame */
+	bool inframe;			/* STX received */
+	bool keyframe;			/* this frame is a full one */
+	unsigned long nbbatch;	/* frames seen */
+
+	struct TIReader rd;		/* Incoming data */
+	struct PubLabel *staged;	/* values of the frame being received */
+	struct PubLabel *stagedlast;
+	struct PubQueue queue;	/* Outgoing data */
+	const char *storedir;	/* Local time series */
+	unsigned int storeseg;	/* Segments' duration (seconds) */
+	unsigned int storekeep;	/* Segments kept (0 : all) */
+	const char *spoolfile;	/* Store and forward */
+	struct Spool spool;
+	const char *snapshot;	/* Shared memory segment's name */
+	struct TISnapshot *snap;	/* ... mapped */
+	struct Sink *sinks;		/* Additional outputs */
+
+		/* Hot reload (see Reload.c) */
+	struct CSection *_Atomic reload;	/* to be applied at the next frame */
+	struct CSection *_Atomic retired;	/* replaced, to be freed (stacked by next) */
+#ifdef LATENCY_STATS
+	int64_t parsed;			/* current event's parsing time (µs since epoch) */
+	struct Histogram latency[LS_NB];
+	atomic_ulong untracked;	/* deliveries not measured (see papub()) */
+#endif
+};
+
+	/* Broker's acknowledgements */
+struct BrokerStats {
+	atomic_ulong delivered;	/* confirmed by the library (PUBACK/PUBCOMP for QoS > 0) */
+	atomic_ulong failed;	/* failed attempts */
+	atomic_ulong retried;	/* attempts sent again */
+	atomic_ulong lost;		/* given up */
+	atomic_ulong aliased;	/* sent with a topic alias only (MQTT 5) */
+	atomic_uint inflight;	/* sent, not confirmed yet */
 };
+extern struct BrokerStats brokerstats;
 
 	/* Where to find default configuration file */
 #define DEFAULT_CONFIGURATION_FILE "/usr/local/etc/TeleInfod.conf"
@@ -39,6 +274,60 @@ struct CSection {	/* Section of the configuration : a TéléInfo flow */
 	/* Keep alive signal to the broker */
 #define BRK_KEEPALIVE 60
 
+	/* Default size of publishing queues (bytes) */
+#define DEFAULT_QUEUE_SIZE 65536
+
+	/* Default size of spools (bytes) */
+#define DEFAULT_SPOOL_SIZE (1024*1024)
+
+	/* Default replay rate after a broker outage (messages per second) */
+#define DEFAULT_REPLAY_RATE 50
+
+	/* Default local storage segments' duration (seconds) */
+#define DEFAULT_STORE_SEGMENT 86400
+
+	/* Default period of latency reports (seconds) */
+#define DEFAULT_LATENCY_INTERVAL 60
+
+	/* Threads' stack (KB, 0 : system's default) */
+#ifdef SMALL_FOOTPRINT
+#	define DEFAULT_THREAD_STACK 64
+#else
+#	define DEFAULT_THREAD_STACK 0
+#endif
+
+	/* Startup arena's chunks (SMALL_FOOTPRINT) */
+#define ARENA_CHUNK (64*1024)
+
+	/* Delay between reconnection attempts (seconds) */
+#define BRK_RECONNECT 5
+
+	/* Default in-flight window of the asynchronous backend (messages) */
+#define DEFAULT_INFLIGHT 20
+
+	/* Attempts to deliver a message before giving up */
+#define BRK_RETRIES 3
+
+	/* Topic aliases TeleInfod may assign (MQTT 5) */
+#define DEFAULT_ALIASES 256
+
+	/* Average topic's room in aliases' pool (bytes) */
+#define ALIAS_TOPIC 64
+
+	/* Additional outputs' defaults */
+#define SINK_MEASUREMENT "teleinfo"
+#define SINK_UDP_BATCH 1400		/* a datagram fits in an Ethernet frame */
+#define SINK_UNIX_BATCH 8192
+#define SINK_MQTT_BATCH 4096
+#define SINK_LINE 512			/* Longest line built for a value */
+#define SINK_TIMEOUT 5			/* seconds to write on a stream */
+
+	/* Events handled per epoll_wait() by engine's workers */
+#define WORKER_EVENTS 32
+
+	/* Largest whole frame message */
+#define FRAMEBATCH_SZ 4096
+
 	/* Maximum length of a line to be read */
 #define MAXLINE 1024
 
@@ -0,0 +1,266 @@
+/*
+ *	Decode.c
+ *		Turn groups into typed values
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Each published label keeps its last value, decoded according to its
+ * type (see Labels.c) : this is the section's snapshot. Numbers are
+ * checked against their range, tariff periods become enums, STGE a
+ * bitfield and horodates epoch seconds. The text to publish is built at
+ * the same time (numbers without leading zeros), so sinks never have
+ * to parse a value again.
+ *
+ * Groups are first decoded as pending values, listed in reception order.
+ * They become the snapshot (and are published) only when the frame's ETX
+ * is received : values of an interrupted frame are dropped.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+	/* Historic tariff periods (PTEC), code is index + 1 */
+static const char *periods[] = {
+	"TH..", "HC..", "HP..", "HN..", "PM..",
+	"HCJB", "HCJW", "HCJR", "HPJB", "HPJW", "HPJR",
+	NULL
+};
+
+static bool decodeNumber(const char *s, size_t len, uint64_t max, uint64_t *v){
+/* Decimal value, without overflow
+ * <- false if not a number or out of range
+ */
+	uint64_t n = 0;
+
+	if(!len)
+		return false;
+
+	for(size_t i=0; i<len; i++){
+		unsigned int d = (unsigned char)s[i] - '0';
+		if(d > 9 || n > (max - d) / 10)
+			return false;
+		n = n*10 + d;
+	}
+
+	*v = n;
+	return true;
+}
+
+static bool decodeHex(const char *s, size_t len, uint64_t *v){
+	uint64_t n = 0;
+
+	if(!len || len > 8)
+		return false;
+
+	for(size_t i=0; i<len; i++){
+		unsigned char c = s[i];
+		if(c >= '0' && c <= '9')
+			c -= '0';
+		else if(c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else if(c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else
+			return false;
+		n = (n << 4) | c;
+	}
+
+	*v = n;
+	return true;
+}
+
+int64_t horodate2epoch(const char *hd, size_t len){
+/* Convert a "SAAMMJJhhmmss" horodate
+ * S is the season : E (summer, UTC+2) or H (winter, UTC+1), in lower case
+ * if the meter's clock is degraded, space if unknown (local time is then
+ * used).
+ * <- epoch seconds, 0 if invalid
+ */
+	uint64_t f[6];
+	struct tm tm;
+
+	if(len != 13)
+		return 0;
+
+	for(int i=0; i<6; i++)
+		if(!decodeNumber(hd + 1 + i*2, 2, 99, f+i))
+			return 0;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = f[0] + 100;	/* 20YY */
+	tm.tm_mon = f[1] - 1;
+	tm.tm_mday = f[2];
+	tm.tm_hour = f[3];
+	tm.tm_min = f[4];
+	tm.tm_sec = f[5];
+
+	switch(hd[0]){
+	case 'E':
+	case 'e':
+		return (int64_t)timegm(&tm) - 7200;
+	case 'H':
+	case 'h':
+		return (int64_t)timegm(&tm) - 3600;
+	default :
+		tm.tm_isdst = -1;
+		return (int64_t)mktime(&tm);
+	}
+}
+
+static void setText(struct TIValue *v, const char *s, size_t len){
+	if(len > VALUE_MAX)
+		len = VALUE_MAX;
+	memcpy(v->text, s, len);
+	v->text[len] = 0;
+	v->len = len;
+}
+
+static bool decode(struct TIValue *v, struct PubLabel *pl, struct TIGroup *grp){
+/* Decode the group in v
+ * <- false if there is nothing to publish (empty payload), v is untouched
+ */
+	const char *s = grp->value;
+	size_t len = grp->vlen;
+	int64_t stamp = 0;
+	struct timespec now;
+
+	if(grp->horodate){
+		if(!len){	/* Only a date (DATE) */
+			s = grp->horodate;
+			len = grp->hlen;
+		} else
+			stamp = horodate2epoch(grp->horodate, grp->hlen);
+	}
+
+	if(!len)	/* Empty payload */
+		return false;
+
+	v->stamp = stamp;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	v->received = now.tv_sec;
+	v->valid = false;
+
+	switch(pl->type){
+	case VT_U32:
+	case VT_U64:
+		if((v->valid = decodeNumber(s, len, (pl->type == VT_U32) ? UINT32_MAX : UINT64_MAX, &v->num))){
+			while(len > 1 && *s == '0'){	/* Normalised text */
+				s++;
+				len--;
+			}
+		}
+		break;
+	case VT_ENUM:
+		if(pl->flags & LF_RAW){	/* Named period */
+			v->num = 0;
+			for(unsigned int i=0; periods[i]; i++)
+				if(len == strlen(periods[i]) && !memcmp(s, periods[i], len)){
+					v->num = i + 1;
+					break;
+				}
+			v->valid = v->num != 0;
+		} else if((v->valid = decodeNumber(s, len, UINT32_MAX, &v->num))){	/* Index */
+			while(len > 1 && *s == '0'){
+				s++;
+				len--;
+			}
+		}
+		break;
+	case VT_BITS:
+		v->valid = decodeHex(s, len, &v->num);
+		break;
+	case VT_DATE:
+		v->valid = (v->num = horodate2epoch(s, len)) != 0;
+		break;
+	default :
+		break;
+	}
+
+	setText(v, s, len);
+	return true;
+}
+
+bool stageGroup(struct CSection *s, struct PubLabel *pl, struct TIGroup *grp){
+/* Decode a group of the frame being received (reader side)
+ * <- false if there is nothing to publish (empty payload)
+ */
+	if(!decode(&pl->pending, pl, grp))
+		return false;
+
+	const char *hd = grp->vlen ? grp->horodate : NULL;	/* The date is embedded (DATE is only a date) */
+	if((pl->dated = hd != NULL)){
+		size_t len = (grp->hlen > VALUE_MAX) ? VALUE_MAX : grp->hlen;
+		memcpy(pl->hd, hd, len);	/* The reader's buffer will be reused */
+		pl->hd[len] = 0;
+		pl->hlen = len;
+	}
+
+	if(!pl->staged){	/* Received twice : the last one wins */
+		pl->staged = true;
+		pl->nextstaged = NULL;
+		if(s->stagedlast)
+			s->stagedlast->nextstaged = pl;
+		else
+			s->staged = pl;
+		s->stagedlast = pl;
+	}
+	return true;
+}
+
+void dropStaged(struct CSection *s){
+/* Forget pending values : the frame is over or interrupted */
+	for(struct PubLabel *pl = s->staged; pl; pl = pl->nextstaged)
+		pl->staged = false;
+	s->staged = s->stagedlast = NULL;
+}
+
+void applyValue(struct PubLabel *pl){
+/* The frame is complete : the pending value becomes label's snapshot
+ * The sequence is odd while the value is being changed, so others
+ * threads can read it without locking (see snapshotValue()).
+ */
+	atomic_fetch_add_explicit(&pl->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&pl->value, &pl->pending, offsetof(struct TIValue, text) + pl->pending.len + 1);
+
+	atomic_fetch_add_explicit(&pl->seq, 1, memory_order_release);
+}
+
+void snapshotValue(struct PubLabel *pl, struct TIValue *v){
+/* Consistent copy of label's value, from any thread
+ * Retries if the reader updated it meanwhile.
+ */
+	unsigned int seq;
+
+	for(;;){
+		seq = atomic_load_explicit(&pl->seq, memory_order_acquire);
+		if(seq & 1){	/* Being updated */
+			sched_yield();
+			continue;
+		}
+
+		memcpy(v, &pl->value, sizeof(struct TIValue));
+
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&pl->seq, memory_order_relaxed) == seq)
+			return;
+	}
+}
@@ -0,0 +1,159 @@
+/*
+ *	Encode.c
+ *		Binary payloads (CBOR or MessagePack)
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * With Encoding=cbor (RFC 8949) or Encoding=msgpack, payloads are built
+ * from decoded values (see Decode.c) : numbers as native unsigned
+ * integers, horodates as timestamps (CBOR tag 1, MessagePack extension
+ * -1), everything else as text strings.
+ * Only the few items needed here are implemented, always in their
+ * shortest form.
+ */
+
+#include <string.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static size_t bigEndian(char *buf, uint64_t v, unsigned int nb){
+	for(unsigned int i=0; i<nb; i++)
+		buf[i] = (char)(v >> (8*(nb - 1 - i)));
+	return nb;
+}
+
+static size_t cborHead(char *buf, unsigned char major, uint64_t v){
+/* Initial byte and argument of a CBOR item */
+	major <<= 5;
+
+	if(v < 24){
+		*buf = major | v;
+		return 1;
+	} else if(v <= UINT8_MAX){
+		*buf = major | 24;
+		return 1 + bigEndian(buf+1, v, 1);
+	} else if(v <= UINT16_MAX){
+		*buf = major | 25;
+		return 1 + bigEndian(buf+1, v, 2);
+	} else if(v <= UINT32_MAX){
+		*buf = major | 26;
+		return 1 + bigEndian(buf+1, v, 4);
+	}
+	*buf = major | 27;
+	return 1 + bigEndian(buf+1, v, 8);
+}
+
+size_t encodeUint(enum Encoding enc, char *buf, uint64_t v){
+	if(enc == ENC_CBOR)
+		return cborHead(buf, 0, v);
+
+		/* MessagePack */
+	if(v < 128){	/* positive fixint */
+		*buf = v;
+		return 1;
+	} else if(v <= UINT8_MAX){
+		*buf = 0xcc;
+		return 1 + bigEndian(buf+1, v, 1);
+	} else if(v <= UINT16_MAX){
+		*buf = 0xcd;
+		return 1 + bigEndian(buf+1, v, 2);
+	} else if(v <= UINT32_MAX){
+		*buf = 0xce;
+		return 1 + bigEndian(buf+1, v, 4);
+	}
+	*buf = 0xcf;
+	return 1 + bigEndian(buf+1, v, 8);
+}
+
+size_t encodeText(enum Encoding enc, char *buf, const char *s, size_t len){
+/* buf has to be at least len + 5 bytes long */
+	size_t h;
+
+	if(enc == ENC_CBOR)
+		h = cborHead(buf, 3, len);
+	else if(len < 32){	/* fixstr */
+		*buf = 0xa0 | len;
+		h = 1;
+	} else if(len <= UINT8_MAX){
+		*buf = 0xd9;
+		h = 1 + bigEndian(buf+1, len, 1);
+	} else if(len <= UINT16_MAX){
+		*buf = 0xda;
+		h = 1 + bigEndian(buf+1, len, 2);
+	} else {
+		*buf = 0xdb;
+		h = 1 + bigEndian(buf+1, len, 4);
+	}
+
+	memcpy(buf + h, s, len);
+	return h + len;
+}
+
+size_t encodeStamp(enum Encoding enc, char *buf, int64_t t){
+/* Epoch seconds as timestamp */
+	if(enc == ENC_CBOR){
+		*buf = 0xc1;	/* tag 1 : epoch based date/time */
+		if(t < 0)
+			return 1 + cborHead(buf+1, 1, -1 - t);
+		return 1 + cborHead(buf+1, 0, t);
+	}
+
+		/* MessagePack timestamp extension */
+	if(t >= 0 && t <= UINT32_MAX){	/* timestamp 32 */
+		buf[0] = 0xd6;
+		buf[1] = -1;
+		return 2 + bigEndian(buf+2, t, 4);
+	}
+	buf[0] = 0xc7;	/* timestamp 96 */
+	buf[1] = 12;
+	buf[2] = -1;
+	bigEndian(buf+3, 0, 4);	/* nanoseconds */
+	return 7 + bigEndian(buf+7, (uint64_t)t, 8);
+}
+
+size_t encodeArray(enum Encoding enc, char *buf, unsigned int nb){
+/* Header of a nb items array (nb < 16) */
+	if(enc == ENC_CBOR)
+		return cborHead(buf, 4, nb);
+	*buf = 0x90 | nb;	/* fixarray */
+	return 1;
+}
+
+size_t encodeValue(enum Encoding enc, char *buf, const struct PubLabel *pl){
+/* Label's decoded value
+ * buf has to be at least VALUE_MAX + 5 bytes long
+ */
+	const struct TIValue *v = &pl->value;
+
+	if(v->valid){
+		if(pl->type == VT_DATE)
+			return encodeStamp(enc, buf, v->num);
+		if(pl->type == VT_BITS || !(pl->flags & LF_RAW))
+			return encodeUint(enc, buf, v->num);
+	}
+	return encodeText(enc, buf, v->text, v->len);
+}
+
+bool parseEncoding(struct CSection *s, const char *enc){
+/* <- false if unknown */
+	if(!strcmp(enc, "text"))
+		s->encoding = ENC_TEXT;
+	else if(!strcmp(enc, "cbor"))
+		s->encoding = ENC_CBOR;
+	else if(!strcmp(enc, "msgpack"))
+		s->encoding = ENC_MSGPACK;
+	else
+		return false;
+	return true;
+}
@@ -0,0 +1,157 @@
+/*
+ *	Engine.c
+ *		Multiplex many sections on a small pool of threads
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * By default, each section has its own thread, blocked in read().
+ * With Workers=<n>, ports are opened non blocking and spread among
+ * <n> workers, each waiting on its own epoll instance : the reader being
+ * a resumable state machine (see Reader.c), a worker consumes whatever
+ * is available and goes back waiting. As a section is always handled by
+ * the same worker, no locking is needed.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/epoll.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+void streamClosed(struct CSection *ctx){
+/* The input is over : nothing more to read from this section */
+	if(debug){
+		printf("*d*  [%s] Input stream closed.\n", ctx->name);
+		printf("*d*  [%s] %lu valid groups, %lu corrupted\n", ctx->name, ctx->rd.nbgood, ctx->rd.nbbad);
+		printf("*d*  [%s] %lu complete frames, %lu interrupted (period %.3f s, jitter %.3f ms)\n", ctx->name, ctx->rd.nbframes, ctx->rd.nbaborted, ctx->rd.frame.period / 1e6, ctx->rd.frame.jitter / 1e3);
+		printf("*d*  [%s] %lu bytes in %lu reads\n", ctx->name, ctx->rd.nbbytes, ctx->rd.nbreads);
+		printf("*d*  [%s] %lu messages published, %lu dropped\n", ctx->name, atomic_load(&ctx->queue.published), atomic_load(&ctx->queue.dropped));
+	}
+	close(ctx->rd.fd);
+	if(ctx->storedir)
+		closeStore(ctx);
+}
+
+static bool serviceSection(struct CSection *ctx){
+/* Process all data available for a section
+ * <- false if its stream is over
+ */
+	struct TIGroup grp;
+	enum TIEvent ev;
+	int r;
+
+	for(;;){
+		while((ev = nextEvent(&ctx->rd, &grp))){
+			if(ctx->standard)
+				handleStandard(ctx, ev, &grp);
+			else
+				handleHistoric(ctx, ev, &grp);
+		}
+
+		if((r = fillReader(&ctx->rd)) > 0)
+			continue;
+
+		if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;	/* Wait for more */
+
+		if(r < 0)
+			perror(ctx->port);
+		return false;
+	}
+}
+
+static void *worker(void *actx){
+	int ep = (int)(intptr_t)actx;
+	struct epoll_event evs[WORKER_EVENTS];
+
+	for(;;){
+		int n = epoll_wait(ep, evs, WORKER_EVENTS, -1);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		for(int i=0; i<n; i++){
+			struct CSection *s = evs[i].data.ptr;
+			if(!serviceSection(s))
+				streamClosed(s);	/* closing the fd removes it from the epoll set */
+		}
+	}
+
+	return NULL;
+}
+
+void startEngine(struct CSection *sections, unsigned int nbworkers){
+/* Spread sections among nbworkers threads */
+	pthread_attr_t thread_attr;
+	pthread_t thread;
+	unsigned int i = 0;
+
+	for(struct CSection *s = sections; s; s = s->next)
+		i++;
+	if(nbworkers > i)	/* Not more workers than sections */
+		nbworkers = i;
+
+	int eps[nbworkers];
+	for(unsigned int w=0; w<nbworkers; w++)
+		if((eps[w] = epoll_create1(EPOLL_CLOEXEC)) == -1){
+			perror("epoll_create1()");
+			exit(EXIT_FAILURE);
+		}
+
+	initThreadAttr(&thread_attr);
+
+	i = 0;
+	for(struct CSection *s = sections; s; s = s->next){
+		struct epoll_event ev;
+
+		initReader(&s->rd, openPort(s, true), s->standard ? 0x09 : 0x20);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		if(epoll_ctl(eps[i % nbworkers], EPOLL_CTL_ADD, s->rd.fd, &ev) == -1){
+			if(errno != EPERM){
+				perror(s->port);
+				exit(EXIT_FAILURE);
+			}
+
+				/* Regular files can't be polled : dedicated thread */
+			close(s->rd.fd);
+			if(debug)
+				printf("*I* [%s] can't be multiplexed : using its own thread\n", s->name);
+			if(pthread_create( &(s->thread), &thread_attr, s->standard ? process_standard : process_historic, s)){
+				fputs("*F* Can't create a processing thread\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		if(debug)
+			printf("*I* [%s] handled by worker %u\n", s->name, i % nbworkers);
+		i++;
+	}
+
+	for(unsigned int w=0; w<nbworkers; w++)
+		if(pthread_create( &thread, &thread_attr, worker, (void *)(intptr_t)eps[w])){
+			fputs("*F* Can't create a worker thread\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+}
@@ -0,0 +1,153 @@
+/*
+ *	Helpers.c
+ *		Shared helpers
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Kept apart from TeleInfod.c (main and MQTT backends) so that parsing
+ * code can be linked in other tools (see ../Bench.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <assert.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+unsigned int debug = 0;
+size_t threadstack = 0;	/* 0 : system's default */
+
+	/* **
+	 * Helpers
+	 * **/
+char *removeLF(char *s){
+	size_t l=strlen(s);
+	if(l && s[--l] == '\n')
+		s[l] = 0;
+	return s;
+}
+
+char *striKWcmp( char *s, const char *kw ){
+/* compares string s against kw
+ * Returns :
+ * 	- remaining string if the keyword matches
+ * 	- NULL if the keyword is not found
+ */
+	size_t klen = strlen(kw);
+	if( strncasecmp(s,kw,klen) )
+		return NULL;
+	else
+		return s+klen;
+}
+
+jmp_buf *configjmp = NULL;	/* Set while reloading the configuration */
+
+void configError(void){
+/* Configuration issue : fatal, unless reloading */
+	if(configjmp)
+		longjmp(*configjmp, 1);
+	exit(EXIT_FAILURE);
+}
+
+int64_t nowUS(void){
+/* <- current time in µs since epoch */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void initThreadAttr(pthread_attr_t *attr){
+/* Attributes of TeleInfod's own threads : detached, with Thread_Stack= */
+	assert(!pthread_attr_init(attr));
+	assert(!pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED));
+	if(threadstack)
+		assert(!pthread_attr_setstacksize(attr, threadstack));
+}
+
+#ifdef SMALL_FOOTPRINT
+	/* **
+	 * Startup arena
+	 *
+	 * Configuration, label sets, topics, queues and buffers are carved
+	 * from a few large chunks, never freed. Once running, the arena is
+	 * sealed : any further allocation is a bug and aborts.
+	 * **/
+struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size, used;
+	char data[] __attribute__((aligned(16)));
+};
+
+static struct ArenaChunk *arena;
+static size_t arenatotal, arenaused;
+static bool sealed;
+
+void *arenaAlloc(size_t sz){
+/* <- zeroed memory */
+	sz = (sz + 15) & ~(size_t)15;
+
+	if(sealed){
+		fprintf(stderr, "*F* %lu bytes requested once running\n", (unsigned long)sz);
+		abort();
+	}
+
+	struct ArenaChunk *c = arena;
+	if(!c || c->size - c->used < sz){
+		size_t csz = (sz > ARENA_CHUNK/4) ? sz : ARENA_CHUNK;
+		assert( (c = calloc(1, sizeof(struct ArenaChunk) + csz)) );	/* untouched pages aren't resident */
+		c->size = csz;
+		c->used = 0;
+		arenatotal += csz;
+
+		if(arena && csz != ARENA_CHUNK){	/* Dedicated : current chunk is kept */
+			c->next = arena->next;
+			arena->next = c;
+		} else {
+			c->next = arena;
+			arena = c;
+		}
+	}
+
+	void *p = c->data + c->used;	/* chunks are zeroed and never reused */
+	c->used += sz;
+	arenaused += sz;
+	return p;
+}
+
+char *arenaStrdup(const char *s){
+	size_t l = strlen(s) + 1;
+	return memcpy(arenaAlloc(l), s, l);
+}
+
+void arenaSeal(void){
+	sealed = true;
+	if(debug)
+		printf("*I* Startup arena : %lu bytes used out of %lu\n", (unsigned long)arenaused, (unsigned long)arenatotal);
+}
+#endif
+
+	/* **
+	 * Frame's handling
+	 * **/
+void debugchar(const char x){
+	if(debug>1){
+		if(isprint(x))
+			putchar(x);
+		else
+			printf("<%02x>", x);
+	}
+}
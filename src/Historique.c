@@ -17,59 +17,98 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "TeleInfod.h"
 #include "Config.h"
 
-void *process_historic(void *actx){
-	struct CSection *ctx = actx;	/* Only to avoid zillions of cast */
-	FILE *fframe;
-
-		/* Target topics */
-	int sz = strlen(ctx->topic);	/* Size of its root */
-	char topic[ sz + 14];
-	strcpy(topic, ctx->topic);
-	topic[sz++] = '/';
-
-	if(debug)
-		printf("Launching a processing historic for '%s'\n", ctx->name);
+void initHistoric(struct CSection *ctx){
+/* Build topics of labels to publish */
+	struct LabelSet *set = ctx->pub;
 
-	char buffer[16];	/* 16 : for the largest field content */
-	
-	if(!(fframe = fopen( ctx->port, "r" ))){
-		perror(ctx->port);
-		exit(EXIT_FAILURE);
+	for(unsigned int i=0; i<set->nb; i++){
+		struct PubLabel *pl = set->labels + i;
+		buildTopic(&pl->topic, ctx->topic, pl->name, NULL);
 	}
+}
 
-	while(getLabel(fframe, buffer, 0x20)){	/* Reading data */
-		if(strstr(ctx->labels, buffer)){	/* Found in topic to publish */
-			strcpy(topic + sz, buffer);
+static void publishValue(struct CSection *ctx, struct PubLabel *pl){
+/* Apply and publish a value of the completed frame */
+	applyValue(pl);
+	if(ctx->storedir)
+		storeValue(ctx, pl);
 
-			bool raw = (bool) strstr(	/* Non numeric values */
-				"ADCO,OPTARIF,PEJP,PTEC,DEMAIN,HHPHC,MOTDETAT",
-			buffer);
+	bool changed = valueChanged(ctx, pl);
+	if(changed || ctx->keyframes)	/* Key frames need all values */
+		batchAdd(ctx, pl, NULL);
+	if(!changed)	/* Nothing new */
+		return;
+	if(ctx->sinks)
+		sinkValue(ctx, pl);
 
-			if(!getPayload(fframe, buffer, 0x20, 16))
-				break;	/* File is over */
-	
-			if(!*buffer)	/* Can't load the payload */
-				continue;
+	if(pl->topic.name){
+		const char *payload = pl->value.text;
+		size_t len = pl->value.len;
+		char buf[VALUE_MAX + 16];
 
-			if(!raw){
-				unsigned int t = atoi(buffer);
-				sprintf(buffer, "%u", t);
-			}
+		if(ctx->encoding != ENC_TEXT){
+			len = encodeValue(ctx->encoding, buf, pl);
+			payload = buf;
+		}
 
-			if(debug)
-				printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, topic, buffer);
+		if(debug)
+			printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, pl->topic.name, pl->value.text);
 
-			papub(topic, strlen(buffer), buffer, 0);
-		}
+		qpublish(ctx, pl->topic.name, pl->topic.len, len, payload, 0);
 	}
+}
+
+void handleHistoric(struct CSection *ctx, enum TIEvent ev, struct TIGroup *grp){
+/* Process an event read from the stream
+ * Values are held until the frame is complete (see Decode.c)
+ */
+#ifdef LATENCY_STATS
+	latencyParsed(ctx);
+#endif
 
-	if(debug){
-		printf("*d*  [%s] Input stream closed : thread is finished.\n", ctx->name);
+	if(ev == TIE_STX){
+		dropStaged(ctx);	/* Groups received outside a frame */
+		if(atomic_load_explicit(&ctx->reload, memory_order_relaxed))	/* New configuration */
+			applyConfiguration(ctx);
+		batchStart(ctx);
+		return;
+	} else if(ev == TIE_ETX){
+		for(struct PubLabel *pl = ctx->staged; pl; pl = pl->nextstaged)
+			publishValue(ctx, pl);
+		dropStaged(ctx);
+		batchPublish(ctx);
+		if(ctx->snap)
+			snapshotFrame(ctx);
+		return;
+	} else if(ev == TIE_EOT){
+		dropStaged(ctx);
+		batchAbort(ctx);
+		return;
 	}
-	fclose(fframe);
+
+	struct PubLabel *pl = findLabel(ctx->pub, grp->label);
+	if(pl)	/* Found in topic to publish */
+		stageGroup(ctx, pl, grp);
+}
+
+void *process_historic(void *actx){
+	struct CSection *ctx = actx;	/* Only to avoid zillions of cast */
+	struct TIGroup grp;
+	enum TIEvent ev;
+
+	if(debug)
+		printf("Launching a processing historic for '%s'\n", ctx->name);
+
+	initReader(&ctx->rd, openPort(ctx, false), 0x20);
+
+	while((ev = readEvent(&ctx->rd, &grp)))	/* Reading data */
+		handleHistoric(ctx, ev, &grp);
+
+	streamClosed(ctx);
 	pthread_exit(0);
 }
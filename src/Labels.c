@@ -0,0 +1,277 @@
+/*
+ *	Labels.c
+ *		Known labels and compiled Publish= filter
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Publish= is compiled once at startup in a small open addressing hash
+ * table : checking if a label has to be published is a single probe
+ * (or very few) and, unlike strstr(), only exact matches are accepted.
+ * Patterns (like EASF* or SMAXSN*) are expanded against known labels.
+ *
+ * When Refresh= is set, each published label keeps a small cache of what
+ * has been published last : unchanged values (or numeric changes within
+ * the label's deadband) are not published again until Refresh= seconds.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <assert.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+struct KnownLabel {
+	const char *name;
+	unsigned int flags;
+	enum ValueType type;
+};
+
+	/* As defined in Enedis-NOI-CPT_54E */
+static const struct KnownLabel historic_labels[] = {
+	{ "ADCO", LF_RAW, VT_STRING }, { "OPTARIF", LF_RAW, VT_STRING }, { "ISOUSC", 0, VT_U32 },
+	{ "BASE", 0, VT_U64 }, { "HCHC", 0, VT_U64 }, { "HCHP", 0, VT_U64 },
+	{ "EJPHN", 0, VT_U64 }, { "EJPHPM", 0, VT_U64 },
+	{ "BBRHCJB", 0, VT_U64 }, { "BBRHPJB", 0, VT_U64 }, { "BBRHCJW", 0, VT_U64 },
+	{ "BBRHPJW", 0, VT_U64 }, { "BBRHCJR", 0, VT_U64 }, { "BBRHPJR", 0, VT_U64 },
+	{ "PEJP", LF_RAW, VT_STRING }, { "PTEC", LF_RAW, VT_ENUM }, { "DEMAIN", LF_RAW, VT_STRING },
+	{ "IINST", 0, VT_U32 }, { "IINST1", 0, VT_U32 }, { "IINST2", 0, VT_U32 }, { "IINST3", 0, VT_U32 },
+	{ "ADPS", 0, VT_U32 }, { "IMAX", 0, VT_U32 }, { "IMAX1", 0, VT_U32 }, { "IMAX2", 0, VT_U32 }, { "IMAX3", 0, VT_U32 },
+	{ "PMAX", 0, VT_U32 }, { "PAPP", 0, VT_U32 }, { "HHPHC", LF_RAW, VT_STRING },
+	{ "MOTDETAT", LF_RAW, VT_STRING }, { "PPOT", LF_RAW, VT_STRING },
+	{ "ADIR1", 0, VT_U32 }, { "ADIR2", 0, VT_U32 }, { "ADIR3", 0, VT_U32 },
+	{ NULL, 0, VT_STRING }
+};
+
+static const struct KnownLabel standard_labels[] = {
+	{ "ADSC", LF_RAW, VT_STRING }, { "VTIC", LF_RAW, VT_STRING }, { "DATE", LF_RAW, VT_DATE },
+	{ "NGTF", LF_RAW, VT_STRING }, { "LTARF", LF_RAW, VT_STRING },
+	{ "EAST", 0, VT_U64 },
+	{ "EASF01", 0, VT_U64 }, { "EASF02", 0, VT_U64 }, { "EASF03", 0, VT_U64 }, { "EASF04", 0, VT_U64 }, { "EASF05", 0, VT_U64 },
+	{ "EASF06", 0, VT_U64 }, { "EASF07", 0, VT_U64 }, { "EASF08", 0, VT_U64 }, { "EASF09", 0, VT_U64 }, { "EASF10", 0, VT_U64 },
+	{ "EASD01", 0, VT_U64 }, { "EASD02", 0, VT_U64 }, { "EASD03", 0, VT_U64 }, { "EASD04", 0, VT_U64 },
+	{ "EAIT", 0, VT_U64 },
+	{ "ERQ1", 0, VT_U64 }, { "ERQ2", 0, VT_U64 }, { "ERQ3", 0, VT_U64 }, { "ERQ4", 0, VT_U64 },
+	{ "IRMS1", 0, VT_U32 }, { "IRMS2", 0, VT_U32 }, { "IRMS3", 0, VT_U32 },
+	{ "URMS1", 0, VT_U32 }, { "URMS2", 0, VT_U32 }, { "URMS3", 0, VT_U32 },
+	{ "PREF", 0, VT_U32 }, { "PCOUP", 0, VT_U32 },
+	{ "SINSTS", 0, VT_U32 }, { "SINSTS1", 0, VT_U32 }, { "SINSTS2", 0, VT_U32 }, { "SINSTS3", 0, VT_U32 },
+	{ "SMAXSN", 0, VT_U32 }, { "SMAXSN1", 0, VT_U32 }, { "SMAXSN2", 0, VT_U32 }, { "SMAXSN3", 0, VT_U32 },
+	{ "SMAXSN-1", 0, VT_U32 }, { "SMAXSN1-1", 0, VT_U32 }, { "SMAXSN2-1", 0, VT_U32 }, { "SMAXSN3-1", 0, VT_U32 },
+	{ "SINSTI", 0, VT_U32 }, { "SMAXIN", 0, VT_U32 }, { "SMAXIN-1", 0, VT_U32 },
+	{ "CCASN", 0, VT_U32 }, { "CCASN-1", 0, VT_U32 }, { "CCAIN", 0, VT_U32 }, { "CCAIN-1", 0, VT_U32 },
+	{ "UMOY1", 0, VT_U32 }, { "UMOY2", 0, VT_U32 }, { "UMOY3", 0, VT_U32 },
+	{ "STGE", LF_RAW, VT_BITS },
+	{ "DPM1", 0, VT_U32 }, { "FPM1", 0, VT_U32 }, { "DPM2", 0, VT_U32 }, { "FPM2", 0, VT_U32 }, { "DPM3", 0, VT_U32 }, { "FPM3", 0, VT_U32 },
+	{ "MSG1", LF_RAW, VT_STRING }, { "MSG2", LF_RAW, VT_STRING }, { "PRM", LF_RAW, VT_STRING }, { "RELAIS", LF_RAW, VT_STRING },
+	{ "NTARF", 0, VT_ENUM }, { "NJOURF", 0, VT_U32 }, { "NJOURF+1", 0, VT_U32 },
+	{ "PJOURF+1", LF_RAW, VT_STRING }, { "PPOINTE", LF_RAW, VT_STRING },
+	{ NULL, 0, VT_STRING }
+};
+
+static unsigned int hashLabel(const char *l){
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	while(*l){
+		h ^= (unsigned char)*l++;
+		h *= 16777619u;
+	}
+	return h & (LABELS_HASHSZ - 1);
+}
+
+struct PubLabel *findLabel(struct LabelSet *set, const char *label){
+/* Look for a label to publish
+ * <- its definition or NULL if it has not to be published
+ */
+	unsigned int h = hashLabel(label);
+
+	while(set->slot[h]){
+		struct PubLabel *pl = set->labels + set->slot[h] - 1;
+		if(!strcmp(pl->name, label))
+			return pl;
+		h = (h+1) & (LABELS_HASHSZ - 1);
+	}
+
+	return NULL;
+}
+
+static void addLabel(struct CSection *s, const char *name, unsigned int flags, enum ValueType type){
+	struct LabelSet *set = s->pub;
+
+	if(findLabel(set, name))	/* Already there */
+		return;
+
+	if(set->nb >= LABELS_MAX){
+		fprintf(stderr, "*F* Too many labels to publish for section '%s'\n", s->name);
+		configError();
+	}
+
+	struct PubLabel *pl = set->labels + set->nb++;
+	pl->name = name;
+	pl->flags = flags;
+	pl->type = type;
+	pl->value.valid = false;
+	pl->value.len = 0;
+	atomic_init(&pl->seq, 0);
+	pl->deadband = 0;
+	pl->published = false;
+
+	unsigned int h = hashLabel(name);
+	while(set->slot[h])
+		h = (h+1) & (LABELS_HASHSZ - 1);
+	set->slot[h] = set->nb;	/* index + 1 as 0 means empty */
+}
+
+void buildTopic(struct TopicName *t, const char *root, const char *name, const char *ext){
+/* Intern root/name[ext]
+ * -> root : NULL if this topic is not used
+ * -> ext : NULL if none
+ */
+	if(!root){
+		t->name = NULL;
+		t->len = 0;
+		return;
+	}
+
+	t->len = strlen(root) + 1 + strlen(name) + (ext ? strlen(ext) : 0);
+	assert( (t->name = cfgAlloc(t->len + 1)) );
+	sprintf(t->name, "%s/%s%s", root, name, ext ? ext : "");
+}
+
+void compileLabels(struct CSection *s){
+/* Build the lookup table from Publish= list.
+ * Section's kind has to be known.
+ */
+	const struct KnownLabel *known = s->standard ? standard_labels : historic_labels;
+	char *lst, *tok, *sp;
+
+	struct LabelSet *set;
+
+	assert( (set = cfgCalloc(1, sizeof(struct LabelSet))) );
+	assert( (set->labels = cfgCalloc(LABELS_MAX, sizeof(struct PubLabel))) );
+	s->pub = set;
+
+	char lbuf[strlen(s->labels) + 1];	/* strtok_r() works in place */
+	lst = strcpy(lbuf, s->labels);
+
+	for(tok = strtok_r(lst, ", \t", &sp); tok; tok = strtok_r(NULL, ", \t", &sp)){
+		if(strpbrk(tok, "*?[")){	/* Pattern */
+			bool found = false;
+			for(const struct KnownLabel *k = known; k->name; k++)
+				if(!fnmatch(tok, k->name, 0)){
+					addLabel(s, k->name, k->flags, k->type);
+					found = true;
+				}
+
+			if(!found)
+				fprintf(stderr, "*W* [%s] '%s' doesn't match any known label\n", s->name, tok);
+		} else {
+			const struct KnownLabel *k;
+			for(k = known; k->name; k++)
+				if(!strcmp(tok, k->name))
+					break;
+
+			if(k->name)
+				addLabel(s, k->name, k->flags, k->type);
+			else {	/* Unknown but may be a new one */
+				if(strlen(tok) > LABEL_MAX){
+					fprintf(stderr, "*F* [%s] '%s' is too long to be a label\n", s->name, tok);
+					configError();
+				}
+				if(findLabel(set, tok))	/* Listed twice */
+					continue;
+				if(debug)
+					printf("*W* [%s] '%s' is not a known label\n", s->name, tok);
+				char *n;
+				assert( (n = cfgStrdup(tok)) );
+				addLabel(s, n, LF_OWNED, VT_U32);
+			}
+		}
+	}
+
+	if(s->deadbands){	/* LABEL:delta,... */
+		char dbuf[strlen(s->deadbands) + 1];
+		lst = strcpy(dbuf, s->deadbands);
+
+		for(tok = strtok_r(lst, ", \t", &sp); tok; tok = strtok_r(NULL, ", \t", &sp)){
+			char *v = strchr(tok, ':');
+			if(!v){
+				fprintf(stderr, "*F* [%s] Deadband '%s' : LABEL:delta expected\n", s->name, tok);
+				configError();
+			}
+			*v++ = 0;
+
+			struct PubLabel *pl = findLabel(set, tok);
+			if(!pl)
+				fprintf(stderr, "*W* [%s] Deadband for '%s' which is not published\n", s->name, tok);
+			else if(pl->flags & LF_RAW)
+				fprintf(stderr, "*W* [%s] Deadband ignored for non numeric '%s'\n", s->name, tok);
+			else
+				pl->deadband = strtoul(v, NULL, 10);
+		}
+	}
+
+	if(debug){
+		printf("\t[%s] %u label(s) to publish :", s->name, set->nb);
+		for(unsigned int i=0; i<set->nb; i++)
+			printf(" %s", set->labels[i].name);
+		puts("");
+	}
+}
+
+	/* **
+	 * Publish on change
+	 * **/
+#define FNV64_INIT 14695981039346656037ull
+
+uint64_t hashText(const char *v){
+	uint64_t h = FNV64_INIT;
+
+	while(*v){	/* FNV-1a 64 bits */
+		h ^= (unsigned char)*v++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+bool valueChanged(struct CSection *s, struct PubLabel *pl){
+/* Check if label's new value has to be published and, if so, remember it
+ * <- false if the value can be skipped
+ */
+	if(!s->refresh)	/* Publish on change disabled */
+		return true;
+
+	const struct TIValue *v = &pl->value;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	uint64_t h = v->valid ? v->num : hashText(v->text);
+
+	if(pl->published && now.tv_sec - pl->lastpub < s->refresh && v->stamp == pl->laststamp){
+		if(h == pl->lasthash)
+			return false;
+
+		if(pl->deadband && v->valid){
+			uint64_t delta = (v->num > pl->lastval) ? v->num - pl->lastval : pl->lastval - v->num;
+			if(delta <= pl->deadband)
+				return false;
+		}
+	}
+
+	pl->published = true;
+	pl->lastpub = now.tv_sec;
+	pl->lasthash = h;
+	pl->laststamp = v->stamp;
+	pl->lastval = v->num;
+	return true;
+}
@@ -0,0 +1,202 @@
+/*
+ *	Latency.c
+ *		Where time goes between reception and publishing
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Only built with -DLATENCY_STATS : otherwise, nothing is measured.
+ *
+ * Each event is stamped when the read() bringing it returns, when it
+ * reaches its handler (parsed) and when its messages are queued ; each
+ * message when it is delivered : when papub() returns with QoS 0, when
+ * the broker acknowledges it otherwise. Durations of every stage are
+ * counted, per section, in log-linear histograms (HDR like : 8 buckets
+ * per power of 2, so values are known within 12.5%).
+ * LS_READ and LS_PROCESS are only updated by the reader : recording is
+ * a plain increment, without any lock nor atomic read-modify-write.
+ * Deliveries are recorded by the MQTT library's thread, or by the
+ * publisher with QoS 0 or when the acknowledgement comes before papub()
+ * returns : LS_QUEUE and LS_TOTAL use a relaxed atomic increment. With
+ * libmosquitto and synchronous Paho, deliveries that couldn't be tracked
+ * are counted ("untracked").
+ *
+ * Histograms are dumped on stdout on SIGUSR1 and, if Latency_Topic= is
+ * set, published every Latency_Interval= seconds as JSON on
+ * <Latency_Topic>/<section>.
+ */
+
+#ifdef LATENCY_STATS
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static const char *stages[LS_NB] = { "read", "process", "queue", "total" };
+
+static const char *topic;	/* Where to publish reports (NULL : not published) */
+static unsigned int interval;
+static time_t lastreport;
+static volatile sig_atomic_t dumprequest;
+
+static unsigned int bucket(uint64_t v){
+	if(v > UINT32_MAX)
+		v = UINT32_MAX;
+	if(v < (1 << LATENCY_SUBBITS))
+		return v;
+
+	unsigned int shift = 63 - __builtin_clzll(v) - LATENCY_SUBBITS;
+	return ((shift + 1) << LATENCY_SUBBITS) | ((v >> shift) & ((1 << LATENCY_SUBBITS) - 1));
+}
+
+static uint64_t bucketMax(unsigned int b){
+/* <- highest value counted in this bucket */
+	if(b < (1 << LATENCY_SUBBITS))
+		return b;
+
+	unsigned int shift = (b >> LATENCY_SUBBITS) - 1;
+	uint64_t low = (uint64_t)((1 << LATENCY_SUBBITS) | (b & ((1 << LATENCY_SUBBITS) - 1))) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+void latencyRecord(struct CSection *s, enum LatencyStage st, int64_t us){
+	atomic_ulong *c = &s->latency[st].count[bucket(us < 0 ? 0 : us)];
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void latencyParsed(struct CSection *s){
+/* An event reached its handler */
+	s->parsed = nowUS();
+	latencyRecord(s, LS_READ, s->parsed - s->rd.stamp.real);
+}
+
+static void recordShared(struct CSection *s, enum LatencyStage st, int64_t us){
+/* Histogram updated by more than one thread */
+	atomic_fetch_add_explicit(&s->latency[st].count[bucket(us < 0 ? 0 : us)], 1, memory_order_relaxed);
+}
+
+void latencyDelivered(const struct PubTrack *t){
+/* A queued message is delivered */
+	int64_t d = nowUS() - t->stamp;
+
+	recordShared(t->section, LS_QUEUE, d);
+	recordShared(t->section, LS_TOTAL, d + t->age);
+}
+
+struct Summary {
+	unsigned long count;
+	uint64_t p50, p90, p99, p999, max;
+};
+
+static void summarize(const struct Histogram *h, struct Summary *sm){
+	unsigned long c[LATENCY_BUCKETS];
+
+	memset(sm, 0, sizeof(struct Summary));
+	for(unsigned int b=0; b<LATENCY_BUCKETS; b++)
+		sm->count += (c[b] = atomic_load_explicit(&h->count[b], memory_order_relaxed));
+	if(!sm->count)
+		return;
+
+	const double q[] = { .5, .9, .99, .999 };
+	uint64_t *res[] = { &sm->p50, &sm->p90, &sm->p99, &sm->p999 };
+	unsigned long acc = 0;
+	unsigned int i = 0;
+
+	for(unsigned int b=0; b<LATENCY_BUCKETS; b++){
+		if(!c[b])
+			continue;
+		acc += c[b];
+		for(; i < 4 && acc >= q[i] * sm->count; i++)
+			*res[i] = bucketMax(b);
+		sm->max = bucketMax(b);
+	}
+}
+
+static void dumpLatency(struct CSection *sections){
+	struct Summary sm;
+
+	puts("*I* Latencies (µs) : count p50 p90 p99 p99.9 max");
+	for(struct CSection *s = sections; s; s = s->next){
+		printf("\t[%s] %lu deliveries not tracked\n", s->name, atomic_load_explicit(&s->untracked, memory_order_relaxed));
+		for(unsigned int st=0; st<LS_NB; st++){
+			summarize(&s->latency[st], &sm);
+			printf("\t\t%-8s %8lu %8llu %8llu %8llu %8llu %8llu\n", stages[st], sm.count,
+				(unsigned long long)sm.p50, (unsigned long long)sm.p90,
+				(unsigned long long)sm.p99, (unsigned long long)sm.p999,
+				(unsigned long long)sm.max
+			);
+		}
+	}
+	fflush(stdout);
+}
+
+static void publishLatency(struct CSection *s){
+	char t[strlen(topic) + strlen(s->name) + 2];
+	char msg[LS_NB * 128 + 40];
+	size_t len = 0;
+	struct Summary sm;
+
+	sprintf(t, "%s/%s", topic, s->name);
+
+	msg[len++] = '{';
+	for(unsigned int st=0; st<LS_NB; st++){
+		summarize(&s->latency[st], &sm);
+		len += sprintf(msg + len, "%s\"%s\":{\"count\":%lu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+			st ? "," : "", stages[st], sm.count,
+			(unsigned long long)sm.p50, (unsigned long long)sm.p90,
+			(unsigned long long)sm.p99, (unsigned long long)sm.p999,
+			(unsigned long long)sm.max
+		);
+	}
+	len += sprintf(msg + len, ",\"untracked\":%lu}", atomic_load_explicit(&s->untracked, memory_order_relaxed));
+
+	if(debug)
+		printf("*d* [%s] Latencies : '%.*s'\n", s->name, (int)len, msg);
+	papub(t, len, msg, 0, NULL);
+}
+
+void latencyService(struct CSection *sections){
+/* Called periodically by the publisher */
+	if(dumprequest){
+		dumprequest = 0;
+		dumpLatency(sections);
+	}
+
+	if(topic && brokerConnected()){
+		time_t now = time(NULL);
+		if(now - lastreport >= interval){
+			lastreport = now;
+			for(struct CSection *s = sections; s; s = s->next)
+				publishLatency(s);
+		}
+	}
+}
+
+static void handleUsr1(int na){
+	dumprequest = 1;
+}
+
+void initLatency(struct CSection *sections, const char *atopic, unsigned int ainterval){
+	for(struct CSection *s = sections; s; s = s->next){
+		memset(s->latency, 0, sizeof(s->latency));
+		atomic_init(&s->untracked, 0);
+	}
+
+	topic = atopic;
+	interval = ainterval;
+	lastreport = time(NULL);
+	signal(SIGUSR1, handleUsr1);
+}
+#endif
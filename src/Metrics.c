@@ -0,0 +1,518 @@
+/*
+ *	Metrics.c
+ *		OpenMetrics scrape endpoint
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * With Metrics=[address:]port, a minimal HTTP server answers GET /metrics
+ * with the last value of every published label and daemon's counters,
+ * in OpenMetrics text format, so Prometheus can scrape TeleInfod without
+ * any broker nor bridge.
+ *
+ * It runs in its own thread and only reads : snapshots through their
+ * sequence (see snapshotValue()), counters and queues' indexes
+ * atomically. Readers are never waiting for it.
+ * Label sets replaced by a reload are walked while a response is built :
+ * "building" is odd meanwhile, and metricsQuiesce() waits for it before
+ * they are freed.
+ * Clients are served one at a time, each within METRICS_TIMEOUT seconds
+ * overall : a slow one can't hold the listener longer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+#define METRICS_TIMEOUT	2	/* seconds to receive a request and send its response */
+#ifdef SMALL_FOOTPRINT	/* Response's room, allocated at startup */
+#	define METRICS_BASE		4096
+#	define METRICS_SECTION	16384
+#endif
+
+static struct CSection *sections;
+static time_t started;
+static atomic_ulong building;	/* odd while label sets are walked */
+
+struct FrameRate {	/* frames per second since the previous scrape */
+	unsigned long nbframes;
+	struct timespec when;
+};
+static struct FrameRate *rates;
+
+#ifdef SMALL_FOOTPRINT
+static char *response;
+static size_t responsesz;
+static FILE *responsef;	/* kept open on response */
+#endif
+
+static void printEscaped(FILE *f, const char *s){
+/* Label value, escaped as OpenMetrics requires */
+	for(; *s; s++){
+		if(*s == '\\' || *s == '"')
+			fputc('\\', f);
+		if(*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+}
+
+static void printSection(FILE *f, const char *metric, const struct CSection *s){
+	fprintf(f, "%s{section=\"", metric);
+	printEscaped(f, s->name);
+	fputs("\"} ", f);
+}
+
+static void printSink(FILE *f, const char *metric, const struct CSection *s, const struct Sink *sk){
+	fprintf(f, "%s{section=\"", metric);
+	printEscaped(f, s->name);
+	fputs("\",sink=\"", f);
+	printEscaped(f, sk->target);
+	fputs("\"} ", f);
+}
+
+static void header(FILE *f, const char *metric, const char *type, const char *help){
+	fprintf(f, "# TYPE %s %s\n# HELP %s %s\n", metric, type, metric, help);
+}
+
+static void buildMetrics(FILE *f){
+	struct CSection *s;
+	struct TIValue v;
+	struct timespec now;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	header(f, "teleinfo_value", "gauge", "Last numeric value received");
+	for(s = sections; s; s = s->next){
+		struct LabelSet *set = s->pub;	/* may be replaced meanwhile (reload) */
+
+		for(i = 0; i < set->nb; i++){
+			struct PubLabel *pl = set->labels + i;
+
+			snapshotValue(pl, &v);
+			if(!v.valid)	/* Not numeric */
+				continue;
+
+			fputs("teleinfo_value{section=\"", f);
+			printEscaped(f, s->name);
+			fprintf(f, "\",label=\"%s\"} %llu\n", pl->name, (unsigned long long)v.num);
+		}
+	}
+
+	header(f, "teleinfo_text", "info", "Last textual value received");
+	for(s = sections; s; s = s->next){
+		struct LabelSet *set = s->pub;
+
+		for(i = 0; i < set->nb; i++){
+			struct PubLabel *pl = set->labels + i;
+
+			if(pl->type != VT_STRING)
+				continue;
+			snapshotValue(pl, &v);
+			if(!v.len)
+				continue;
+
+			fputs("teleinfo_text_info{section=\"", f);
+			printEscaped(f, s->name);
+			fprintf(f, "\",label=\"%s\",value=\"", pl->name);
+			printEscaped(f, v.text);
+			fputs("\"} 1\n", f);
+		}
+	}
+
+	header(f, "teleinfo_groups", "counter", "Valid groups parsed");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_groups_total", s);
+		fprintf(f, "%lu\n", s->rd.nbgood);
+	}
+
+	header(f, "teleinfo_checksum_failures", "counter", "Corrupted groups");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_checksum_failures_total", s);
+		fprintf(f, "%lu\n", s->rd.nbbad);
+	}
+
+	header(f, "teleinfo_frames", "counter", "Complete frames received");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_frames_total", s);
+		fprintf(f, "%lu\n", s->rd.nbframes);
+	}
+
+	header(f, "teleinfo_frames_aborted", "counter", "Frames interrupted (EOT) or incomplete");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_frames_aborted_total", s);
+		fprintf(f, "%lu\n", s->rd.nbaborted);
+	}
+
+	header(f, "teleinfo_frame_period_seconds", "gauge", "Delay between the starts of the last 2 complete frames");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_frame_period_seconds", s);
+		fprintf(f, "%.6f\n", s->rd.frame.period / 1e6);
+	}
+
+	header(f, "teleinfo_frame_jitter_seconds", "gauge", "Smoothed variation of the frames' period");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_frame_jitter_seconds", s);
+		fprintf(f, "%.6f\n", s->rd.frame.jitter / 1e6);
+	}
+
+	header(f, "teleinfo_frame_last_timestamp_seconds", "gauge", "Reception of the last complete frame");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_frame_last_timestamp_seconds", s);
+		fprintf(f, "%.6f\n", atomic_load_explicit(&s->rd.frame.last, memory_order_relaxed) / 1e6);
+	}
+
+	header(f, "teleinfo_frames_per_second", "gauge", "Frames received per second since the previous scrape");
+	for(s = sections, i = 0; s; s = s->next, i++){
+		unsigned long nb = s->rd.nbframes;
+		double dt = (now.tv_sec - rates[i].when.tv_sec) + (now.tv_nsec - rates[i].when.tv_nsec) / 1e9;
+
+		printSection(f, "teleinfo_frames_per_second", s);
+		fprintf(f, "%.3f\n", dt > 0 ? (nb - rates[i].nbframes) / dt : 0.0);
+		rates[i].nbframes = nb;
+		rates[i].when = now;
+	}
+
+	header(f, "teleinfo_read_bytes", "counter", "Bytes read from the port");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_read_bytes_total", s);
+		fprintf(f, "%lu\n", s->rd.nbbytes);
+	}
+
+	header(f, "teleinfo_reads", "counter", "Wake ups reading the port (see ReadPolicy=)");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_reads_total", s);
+		fprintf(f, "%lu\n", s->rd.nbreads);
+	}
+
+	header(f, "teleinfo_messages_published", "counter", "Messages sent to the broker");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_messages_published_total", s);
+		fprintf(f, "%lu\n", atomic_load_explicit(&s->queue.published, memory_order_relaxed));
+	}
+
+	header(f, "teleinfo_messages_dropped", "counter", "Messages lost as the publishing queue was full");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_messages_dropped_total", s);
+		fprintf(f, "%lu\n", atomic_load_explicit(&s->queue.dropped, memory_order_relaxed));
+	}
+
+	header(f, "teleinfo_publish_latency_seconds", "summary", "Delay between reception and publishing");
+	for(s = sections; s; s = s->next){
+			/* Loaded in the reverse order they are updated : sum is never
+			 * behind count */
+		unsigned long nb = atomic_load_explicit(&s->queue.published, memory_order_acquire);
+		unsigned long long sum = atomic_load_explicit(&s->queue.latency, memory_order_relaxed);
+
+		printSection(f, "teleinfo_publish_latency_seconds_sum", s);
+		fprintf(f, "%.6f\n", sum / 1e6);
+		printSection(f, "teleinfo_publish_latency_seconds_count", s);
+		fprintf(f, "%lu\n", nb);
+	}
+
+	header(f, "teleinfo_queue_bytes", "gauge", "Bytes waiting in the publishing queue");
+	for(s = sections; s; s = s->next){
+		size_t t = atomic_load_explicit(&s->queue.tail, memory_order_relaxed);
+		size_t h = atomic_load_explicit(&s->queue.head, memory_order_relaxed);
+
+		printSection(f, "teleinfo_queue_bytes", s);
+		fprintf(f, "%lu\n", (unsigned long)(h - t));
+	}
+
+	header(f, "teleinfo_queue_size_bytes", "gauge", "Size of the publishing queue");
+	for(s = sections; s; s = s->next){
+		printSection(f, "teleinfo_queue_size_bytes", s);
+		fprintf(f, "%lu\n", (unsigned long)s->queue.size);
+	}
+
+	header(f, "teleinfo_sink_lines", "counter", "Lines taken from a sink's queue");
+	for(s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+			printSink(f, "teleinfo_sink_lines_total", s, sk);
+			fprintf(f, "%lu\n", atomic_load_explicit(&sk->queue.published, memory_order_relaxed));
+		}
+
+	header(f, "teleinfo_sink_dropped", "counter", "Lines lost as a sink's queue was full");
+	for(s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+			printSink(f, "teleinfo_sink_dropped_total", s, sk);
+			fprintf(f, "%lu\n", atomic_load_explicit(&sk->queue.dropped, memory_order_relaxed));
+		}
+
+	header(f, "teleinfo_sink_lost", "counter", "Lines lost by failed writes");
+	for(s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+			printSink(f, "teleinfo_sink_lost_total", s, sk);
+			fprintf(f, "%lu\n", atomic_load_explicit(&sk->lost, memory_order_relaxed));
+		}
+
+	header(f, "teleinfo_sink_writes", "counter", "Batches sent (datagrams or writes)");
+	for(s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+			printSink(f, "teleinfo_sink_writes_total", s, sk);
+			fprintf(f, "%lu\n", atomic_load_explicit(&sk->writes, memory_order_relaxed));
+		}
+
+	header(f, "teleinfo_sink_queue_bytes", "gauge", "Bytes waiting in a sink's queue");
+	for(s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+			size_t t = atomic_load_explicit(&sk->queue.tail, memory_order_relaxed);
+			size_t h = atomic_load_explicit(&sk->queue.head, memory_order_relaxed);
+
+			printSink(f, "teleinfo_sink_queue_bytes", s, sk);
+			fprintf(f, "%lu\n", (unsigned long)(h - t));
+		}
+
+	header(f, "teleinfo_broker_connected", "gauge", "1 if connected to the broker");
+	fprintf(f, "teleinfo_broker_connected %d\n", brokerConnected() ? 1 : 0);
+
+	header(f, "teleinfo_broker_delivered", "counter", "Messages whose delivery is confirmed");
+	fprintf(f, "teleinfo_broker_delivered_total %lu\n", atomic_load_explicit(&brokerstats.delivered, memory_order_relaxed));
+
+	header(f, "teleinfo_broker_failures", "counter", "Failed delivery attempts");
+	fprintf(f, "teleinfo_broker_failures_total %lu\n", atomic_load_explicit(&brokerstats.failed, memory_order_relaxed));
+
+	header(f, "teleinfo_broker_retries", "counter", "Deliveries attempted again");
+	fprintf(f, "teleinfo_broker_retries_total %lu\n", atomic_load_explicit(&brokerstats.retried, memory_order_relaxed));
+
+	header(f, "teleinfo_broker_lost", "counter", "Messages given up after retries");
+	fprintf(f, "teleinfo_broker_lost_total %lu\n", atomic_load_explicit(&brokerstats.lost, memory_order_relaxed));
+
+	header(f, "teleinfo_broker_aliased", "counter", "Messages sent with a topic alias only (MQTT 5)");
+	fprintf(f, "teleinfo_broker_aliased_total %lu\n", atomic_load_explicit(&brokerstats.aliased, memory_order_relaxed));
+
+	header(f, "teleinfo_broker_inflight", "gauge", "Messages sent but not confirmed yet");
+	fprintf(f, "teleinfo_broker_inflight %u\n", atomic_load_explicit(&brokerstats.inflight, memory_order_relaxed));
+
+	header(f, "teleinfo_start_time_seconds", "gauge", "Daemon's start time");
+	fprintf(f, "teleinfo_start_time_seconds %lld\n", (long long)started);
+
+	fputs("# EOF\n", f);
+}
+
+static int64_t nowMS(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool waitFor(int fd, short events, int64_t deadline){
+/* Wait until the socket is ready, without going past the client's deadline
+ * <- false on timeout or error
+ */
+	struct pollfd pfd = { fd, events, 0 };
+
+	for(;;){
+		int64_t left = deadline - nowMS();
+		if(left <= 0)
+			return false;
+
+		int r = poll(&pfd, 1, (int)left);
+		if(r > 0)
+			return true;
+		if(!r || errno != EINTR)
+			return false;
+	}
+}
+
+static bool sendAll(int fd, const char *buf, size_t len, int64_t deadline){
+	while(len){
+		if(!waitFor(fd, POLLOUT, deadline))
+			return false;
+
+		ssize_t r = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if(r <= 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+static void serve(int fd){
+	int64_t deadline = nowMS() + METRICS_TIMEOUT * 1000;	/* for the whole exchange */
+	char req[MAXLINE];
+	size_t len = 0;
+	ssize_t r;
+
+		/* Only the request line is needed */
+	while(len < sizeof(req) - 1 && !memchr(req, '\n', len)){
+		if(!waitFor(fd, POLLIN, deadline))
+			return;
+		if((r = recv(fd, req + len, sizeof(req) - 1 - len, MSG_DONTWAIT)) < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if(r <= 0)
+			return;
+		len += r;
+	}
+	req[len] = 0;
+
+	if(strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET /metrics?", 13)){
+		static const char notfound[] =
+			"HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+		sendAll(fd, notfound, sizeof(notfound) - 1, deadline);
+		return;
+	}
+
+#ifdef SMALL_FOOTPRINT
+	char *body = response;
+	FILE *f = responsef;
+
+	rewind(f);
+	clearerr(f);
+	atomic_fetch_add(&building, 1);
+	buildMetrics(f);
+	atomic_fetch_add(&building, 1);
+	fflush(f);
+	size_t blen = ftell(f);
+	if(ferror(f) || blen >= responsesz - 1){
+		static const char toolarge[] =
+			"HTTP/1.0 500 Internal Server Error\r\nContent-Type: text/plain\r\nContent-Length: 19\r\nConnection: close\r\n\r\nResponse too large\n";
+		fputs("*E* Metrics don't fit in their buffer\n", stderr);
+		sendAll(fd, toolarge, sizeof(toolarge) - 1, deadline);
+		return;
+	}
+#else
+	char *body = NULL;
+	size_t blen = 0;
+	FILE *f = open_memstream(&body, &blen);
+	if(!f){
+		perror("open_memstream()");
+		return;
+	}
+	atomic_fetch_add(&building, 1);
+	buildMetrics(f);
+	atomic_fetch_add(&building, 1);
+	fclose(f);
+#endif
+
+	char hdr[256];
+	int hlen = sprintf(hdr,
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n\r\n", (unsigned long)blen
+	);
+	if(sendAll(fd, hdr, hlen, deadline))
+		sendAll(fd, body, blen, deadline);
+#ifndef SMALL_FOOTPRINT
+	free(body);
+#endif
+}
+
+void metricsQuiesce(void){
+/* Wait for the response being built, if any : label sets replaced
+ * before can't be walked anymore */
+	atomic_thread_fence(memory_order_seq_cst);	/* after their replacement */
+	unsigned long seq = atomic_load(&building);
+
+	if(seq & 1)
+		while(atomic_load(&building) == seq)
+			usleep(1000);
+}
+
+static void *listener(void *actx){
+	int sock = (int)(intptr_t)actx;
+
+	for(;;){
+		int fd = accept(sock, NULL, NULL);
+		if(fd < 0){
+			if(errno != EINTR && errno != ECONNABORTED)
+				perror("Metrics accept()");
+			continue;
+		}
+
+		serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+void startMetrics(struct CSection *asections, const char *endpoint){
+/* -> endpoint : [address:]port */
+	struct addrinfo hints, *res;
+	char host[strlen(endpoint) + 1];
+	const char *port = strrchr(endpoint, ':');
+	int sock, err, on = 1;
+	unsigned int nb = 0;
+
+	sections = asections;
+	started = time(NULL);
+
+	for(struct CSection *s = sections; s; s = s->next)
+		nb++;
+	assert( (rates = cfgCalloc(nb, sizeof(struct FrameRate))) );
+	for(unsigned int i=0; i<nb; i++)
+		clock_gettime(CLOCK_MONOTONIC, &rates[i].when);
+
+#ifdef SMALL_FOOTPRINT
+	responsesz = METRICS_BASE + nb * METRICS_SECTION;
+	assert( (response = cfgAlloc(responsesz)) );
+	assert( (responsef = fmemopen(response, responsesz, "w")) );
+	setvbuf(responsef, NULL, _IONBF, 0);	/* stdio mustn't allocate its own buffer */
+#endif
+
+	if(port){
+		memcpy(host, endpoint, port - endpoint);
+		host[port - endpoint] = 0;
+		port++;
+	} else {
+		*host = 0;
+		port = endpoint;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if((err = getaddrinfo(*host ? host : NULL, port, &hints, &res))){
+		fprintf(stderr, "*F* Metrics '%s' : %s\n", endpoint, gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	if((sock = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) < 0){
+		perror("Metrics socket()");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(bind(sock, res->ai_addr, res->ai_addrlen) < 0 || listen(sock, 8) < 0){
+		perror(endpoint);
+		exit(EXIT_FAILURE);
+	}
+	freeaddrinfo(res);
+
+	pthread_attr_t thread_attr;
+	pthread_t thread;
+	initThreadAttr(&thread_attr);
+
+	if(pthread_create( &thread, &thread_attr, listener, (void *)(intptr_t)sock)){
+		fputs("*F* Can't create the metrics thread\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if(debug)
+		printf("*I* Metrics served on '%s'\n", endpoint);
+}
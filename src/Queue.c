@@ -0,0 +1,242 @@
+/*
+ *	Queue.c
+ *		Decouple serial readers from the broker
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Each section owns a single producer / single consumer ring of variable
+ * length records (topic + payload). Its reader only pushes into it and
+ * never waits : if the ring is full, the record is dropped and counted.
+ * A unique publisher thread drains all rings and talks to the broker.
+ *
+ * head and tail are free running byte counters ; a record never wraps
+ * around the end of the ring, a padding record is inserted instead.
+ *
+ * The publisher also reconnects to the broker and replays spooled
+ * messages (see Spool.c). While a section's spool isn't empty, its live
+ * messages are spooled behind the backlog.
+ * Sinks' queues are the same rings, each drained by its sink's own
+ * thread (see Sink.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <semaphore.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static sem_t pending;	/* Records waiting to be published */
+
+void initQueue(struct PubQueue *q, size_t size){
+/* -> size : ring's size, rounded up to a power of 2 */
+	size_t sz = 1024;
+	while(sz < size)
+		sz <<= 1;
+
+	assert( (q->ring = cfgAlloc(sz)) );
+	q->size = sz;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->dropped, 0);
+	atomic_init(&q->published, 0);
+	atomic_init(&q->latency, 0);
+}
+
+struct QRecord *qreserve(struct PubQueue *q, const char *topic, size_t tlen, size_t length, const void *payload, size_t *head){
+/* Copy a record in a ring (producer side, never blocks)
+ * -> tlen : topic's length, including its '\0'
+ * <- NULL if there is no room, otherwise the record, whose remaining
+ * 	fields have to be set before qcommit(q, *head)
+ */
+	size_t need = QALIGN(sizeof(struct QRecord) + tlen + length);
+
+	size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&q->tail, memory_order_acquire);
+	size_t pos = h & (q->size - 1);
+	size_t pad = (pos + need > q->size) ? q->size - pos : 0;
+
+	if(tlen > UINT16_MAX || length > UINT16_MAX || need + pad > q->size - (h - t))
+		return NULL;
+
+	if(pad){	/* Not enough room at the end of the ring */
+		((struct QRecord *)(q->ring + pos))->tlen = 0;
+		h += pad;
+		pos = 0;
+	}
+
+	struct QRecord *r = (struct QRecord *)(q->ring + pos);
+	r->tlen = tlen;
+	r->plen = length;
+	memcpy(r + 1, topic, tlen);
+	memcpy((char *)(r + 1) + tlen, payload, length);
+
+	*head = h + need;
+	return r;
+}
+
+void qcommit(struct PubQueue *q, size_t head){
+/* Make reserved records visible to the consumer */
+	atomic_store_explicit(&q->head, head, memory_order_release);
+}
+
+bool qpublish(struct CSection *s, const char *topic, size_t tlen, int length, const void *payload, int retained){
+/* Queue a message to be published (reader side, never blocks)
+ * -> tlen : topic's length
+ * <- false if the queue is full and the message dropped
+ */
+	struct PubQueue *q = &s->queue;
+	size_t h;
+
+	struct QRecord *r = qreserve(q, topic, tlen + 1, length, payload, &h);	/* including its '\0' */
+	if(!r){
+		if(!atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed) || debug)
+			fprintf(stderr, "*W* [%s] Publishing queue full : message dropped\n", s->name);
+		return false;
+	}
+
+	r->retained = retained;
+	r->stamp = nowUS();
+#ifdef LATENCY_STATS
+	latencyRecord(s, LS_PROCESS, r->stamp - s->parsed);
+	int64_t age = r->stamp - s->rd.stamp.real;
+	r->age = (age < 0) ? 0 : (age > 0xffffff) ? 0xffffff : age;
+#else
+	r->age = 0;
+#endif
+
+	qcommit(q, h);
+	sem_post(&pending);
+	return true;
+}
+
+static unsigned int drainQueue(struct CSection *s){
+/* Publish everything queued (publisher side)
+ * Messages are spooled if the broker is unreachable, or behind a backlog
+ * still to be replayed, so they are published in order.
+ * <- number of messages spooled while the broker is up : the replay
+ * 	has to send them on top of its rate for the backlog to drain
+ */
+	struct PubQueue *q = &s->queue;
+	unsigned int nb = 0, behind = 0;
+	uint64_t delays = 0;
+	size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t h = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	while(t != h){
+		size_t pos = t & (q->size - 1);
+		struct QRecord *r = (struct QRecord *)(q->ring + pos);
+
+		if(!r->tlen){	/* padding */
+			t += q->size - pos;
+			continue;
+		}
+
+		const char *topic = (const char *)(r + 1);
+		struct PubTrack track = { s, r->stamp, r->age, 0 };	/* latency ends on delivery */
+		if(s->spoolfile && !brokerConnected())
+			spoolAppend(s, r);
+		else if(!spoolEmpty(s)){	/* Behind the backlog */
+			spoolAppend(s, r);
+			behind++;
+		} else if(papub(topic, r->plen, (void *)(topic + r->tlen), r->retained, &track) < 0){
+			if(s->spoolfile)
+				spoolAppend(s, r);
+		} else {
+			int64_t d = nowUS() - r->stamp;
+			if(d > 0)
+				delays += d;
+			nb++;
+		}
+
+		t += QALIGN(sizeof(struct QRecord) + r->tlen + r->plen);
+		atomic_store_explicit(&q->tail, t, memory_order_release);
+	}
+
+	if(nb){
+		atomic_fetch_add_explicit(&q->latency, delays, memory_order_relaxed);
+		atomic_fetch_add_explicit(&q->published, nb, memory_order_release);
+	}
+	return behind;
+}
+
+static unsigned int replay_rate;
+
+static void *publisher(void *actx){
+	struct CSection *sections = actx;
+	struct timespec last, now, ts;
+	double allowance = 0;	/* spooled messages that can be replayed */
+	unsigned int behind;	/* live messages spooled behind a backlog */
+	bool spooled = false;	/* Some spools are not empty */
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	for(;;){
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if(spooled){	/* Come back soon to continue the replay */
+			ts.tv_nsec += 100000000;
+			if(ts.tv_nsec >= 1000000000){
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+		} else
+			ts.tv_sec++;
+		sem_timedwait(&pending, &ts);
+
+		if(!brokerConnected())
+			brokerReconnect();
+
+		behind = 0;
+		for(struct CSection *s = sections; s; s = s->next)
+			behind += drainQueue(s);
+#ifdef LATENCY_STATS
+		latencyService(sections);
+#endif
+
+			/* Replay spooled messages */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		allowance += ((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9) * replay_rate;
+		if(allowance > replay_rate)
+			allowance = replay_rate;
+		allowance += behind;	/* Replay_Rate= comes on top of live traffic */
+		last = now;
+
+		spooled = false;
+		for(struct CSection *s = sections; s; s = s->next){
+			if(spoolEmpty(s))
+				continue;
+
+			if(brokerConnected() && allowance >= 1)
+				allowance -= spoolReplay(s, (unsigned int)allowance);
+			spooled |= !spoolEmpty(s);
+		}
+	}
+
+	return NULL;
+}
+
+void startPublisher(struct CSection *sections, unsigned int rate){
+	pthread_attr_t thread_attr;
+	pthread_t thread;
+
+	replay_rate = rate;
+
+	assert(!sem_init(&pending, 0, 0));
+	initThreadAttr(&thread_attr);
+
+	if(pthread_create( &thread, &thread_attr, publisher, sections)){
+		fputs("*F* Can't create the publishing thread\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
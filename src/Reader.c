@@ -0,0 +1,302 @@
+/*
+ *	Reader.c
+ *		Buffered reading of TéléInfo groups
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Data are read by chunks in a per section buffer. Groups are located
+ * with memchr() and returned as slices of this buffer : nothing is
+ * copied, separators are only overwritten by '\0' to terminate strings.
+ * Slices remain valid until the next call to nextEvent() / readEvent().
+ * Frame delimiters found between groups, or cutting a group, are reported
+ * as well.
+ *
+ * Frames are followed by a small state machine :
+ *	- STX starts a frame (TIE_STX),
+ *	- ETX ends it (TIE_ETX) ; an ETX without STX (the daemon started in
+ *	the middle of a frame) is only counted,
+ *	- EOT (the meter interrupts its frame) or a new STX without ETX
+ *	report the current frame as interrupted (TIE_EOT) : consumers discard
+ *	what they collected from it.
+ * Each read is stamped with both CLOCK_MONOTONIC and CLOCK_REALTIME ; an
+ * event's reception (rd->stamp) is the one of the read that brought its
+ * first byte. Starts of consecutive complete frames give the frames'
+ * period, and its variations a jitter smoothed as RFC 3550 does.
+ *
+ * Each group ends with a checksum : the sum of its bytes, from the label
+ * up to the separator preceding the checksum, truncated to 6 bits + 0x20.
+ * 	- historic frames (mode 1) : this last separator is excluded,
+ * 	- standard frames (mode 2) : this last separator is included.
+ * Corrupted groups are dropped here and never reach the parsers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static void stampNow(struct TIStamp *st){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	st->mono = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	st->real = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void initReader(struct TIReader *rd, int fd, char sep){
+	rd->fd = fd;
+	rd->sep = sep;
+	rd->start = rd->end = 0;
+	rd->synced = false;
+	rd->nbgood = rd->nbbad = 0;
+	rd->nbreads = rd->nbbytes = 0;
+	rd->nbframes = rd->nbaborted = 0;
+	stampNow(&rd->readstamp);
+	rd->stamp = rd->prevstamp = rd->readstamp;
+	rd->freshpos = 0;
+
+	memset(&rd->frame, 0, sizeof(rd->frame));
+	atomic_init(&rd->frame.last, 0);
+}
+
+int fillReader(struct TIReader *rd){
+/* Read as much data as available in the buffer.
+ * <- number of bytes read, 0 if the file is over, -1 on error
+ */
+	if(rd->start){	/* Move remaining data at the beginning of the buffer */
+		size_t remain = rd->end - rd->start;
+		if(remain)
+			memmove(rd->buf, rd->buf + rd->start, remain);
+		rd->start = 0;
+		rd->end = remain;
+	}
+
+	if(rd->end == READER_BUFSZ){	/* No room left : a group can't be that long */
+		if(debug)
+			puts("*d* Buffer full without a complete group ... restarting");
+		rd->start = rd->end = 0;
+		rd->synced = false;
+	}
+
+	rd->freshpos = rd->end;	/* what is already there came with previous reads */
+	rd->prevstamp = rd->readstamp;
+
+	ssize_t r;
+	do {
+		r = read(rd->fd, rd->buf + rd->end, READER_BUFSZ - rd->end);
+	} while(r < 0 && errno == EINTR);
+
+	if(r > 0){
+		rd->nbreads++;
+		rd->nbbytes += r;
+		if(debug > 1)
+			for(ssize_t i=0; i<r; i++)
+				debugchar(rd->buf[rd->end + i]);
+		rd->end += r;
+		stampNow(&rd->readstamp);
+	}
+
+	return (int)r;
+}
+
+static bool splitGroup(struct TIReader *rd, char *line, size_t len, struct TIGroup *grp){
+/* Cut the group in its fields.
+ * -> line : group's content, without its LF and CR
+ * <- false if the group is malformed
+ */
+	if(len < 4 || line[len-2] != rd->sep)	/* at least 'L' sep sep chk */
+		return false;
+
+	unsigned int sum = (rd->sep == 0x09) ? rd->sep : 0;	/* mode 2 includes the separator */
+	for(size_t i=0; i<len-2; i++)
+		sum += (unsigned char)line[i];
+	if(((sum & 0x3f) + 0x20) != (unsigned char)line[len-1]){
+		if(debug)
+			printf("*d* Bad checksum for '%.*s'\n", (int)(len-2), line);
+		rd->nbbad++;
+		return false;
+	}
+	rd->nbgood++;
+
+	grp->checksum = line[len-1];
+	line[len-2] = 0;	/* end of the value */
+	len -= 2;
+
+	char *p = memchr(line, rd->sep, len);
+	if(!p || p == line || p - line > LABEL_MAX)
+		return false;
+	*p++ = 0;
+	grp->label = line;
+	grp->horodate = NULL;
+	grp->value = p;
+
+	if(rd->sep == 0x09){	/* only standard frames have horodate */
+		char *v = memchr(p, rd->sep, len - (p - line));
+		if(v){
+			*v++ = 0;
+			grp->horodate = p;
+			grp->hlen = v - p - 1;
+			grp->value = v;
+		}
+	}
+
+	grp->vlen = len - (grp->value - line);
+	return true;
+}
+
+static enum TIEvent frameAborted(struct TIReader *rd, const char *why){
+/* The current frame won't be complete */
+	rd->frame.inframe = false;
+	rd->frame.follows = false;
+	rd->nbaborted++;
+
+	if(debug)
+		printf("*d* Frame interrupted (%s) ... discarded\n", why);
+	return TIE_EOT;
+}
+
+static void frameCompleted(struct TIReader *rd){
+	struct TIFrame *f = &rd->frame;
+
+	f->inframe = false;
+	f->end = rd->stamp;
+
+	if(f->follows){	/* Consecutive complete frames */
+		int64_t p = f->start.mono - f->prevstart.mono;
+
+		if(f->period){
+			int64_t d = p - (int64_t)f->period;
+			if(d < 0)
+				d = -d;
+			f->jitter = (int64_t)f->jitter + (d - (int64_t)f->jitter) / 16;
+		}
+		f->period = p;
+	}
+	f->prevstart = f->start;
+	f->follows = true;
+
+	rd->nbframes++;
+	atomic_store_explicit(&f->last, f->end.real, memory_order_relaxed);
+}
+
+static char *delimiter(char *data, size_t len){
+/* Look for a frame delimiter (STX, ETX or EOT) inside a broken group
+ * <- the first one, NULL if none
+ */
+	for(char *p = data; p < data + len; p++)
+		if(*p >= 0x02 && *p <= 0x04)
+			return p;
+	return NULL;
+}
+
+enum TIEvent nextEvent(struct TIReader *rd, struct TIGroup *grp){
+/* Extract the next group or frame delimiter from already buffered data
+ * <- TIE_NONE if more data are needed
+ */
+	for(;;){
+		char *data = rd->buf + rd->start;
+		size_t len = rd->end - rd->start;
+
+		if(!rd->synced){	/* Looking for the beginning of a group */
+			while(rd->start < rd->end){	/* Only few bytes between groups */
+					/* Reception of this event : approximated by the
+					 * read that brought its first byte */
+				rd->stamp = (rd->start < rd->freshpos) ? rd->prevstamp : rd->readstamp;
+
+				switch(rd->buf[rd->start++]){
+				case 0x0a:
+					rd->synced = true;
+					break;
+				case 0x02:
+					if(rd->frame.inframe){	/* ETX lost : STX is read again after */
+						rd->start--;
+						return frameAborted(rd, "STX without ETX");
+					}
+					rd->frame.inframe = true;
+					rd->frame.start = rd->stamp;
+					return TIE_STX;
+				case 0x03:
+					if(!rd->frame.inframe){	/* Its beginning has been missed */
+						rd->frame.follows = false;
+						rd->nbaborted++;
+						if(debug)
+							puts("*d* ETX without STX ... partial frame ignored");
+						continue;
+					}
+					frameCompleted(rd);
+					return TIE_ETX;
+				case 0x04:
+					if(!rd->frame.inframe)
+						continue;
+					return frameAborted(rd, "EOT");
+				default:
+					continue;
+				}
+				break;
+			}
+			if(!rd->synced)
+				return TIE_NONE;
+			continue;
+		}
+
+		char *cr = memchr(data, 0x0d, len);
+		if(!cr)
+			return TIE_NONE;
+
+		size_t glen = cr - data;
+		rd->start += glen + 1;
+		rd->synced = false;
+
+		char *lf = memchr(data, 0x0a, glen);
+		if(lf){	/* Missing CR : restart from this group */
+			char *d = delimiter(data, lf - data);
+			if(debug)
+				puts("*d* Truncated group ... ignoring");
+			rd->start -= glen + 1 - ((d ? d : lf) - data);
+			continue;
+		}
+
+		if(splitGroup(rd, data, glen, grp)){
+			if(debug)
+				printf("*d* Found '%s'\n", grp->label);
+			return TIE_GROUP;
+		}
+
+		char *d = delimiter(data, glen);
+		if(d){	/* Cut by a frame delimiter : let it be handled */
+			if(debug)
+				puts("*d* Truncated group ... ignoring");
+			rd->start -= glen + 1 - (d - data);
+			continue;
+		}
+		if(debug)
+			puts("*d* Malformed group ... ignoring");
+	}
+}
+
+enum TIEvent readEvent(struct TIReader *rd, struct TIGroup *grp){
+/* Wait for the next group or frame delimiter
+ * <- TIE_NONE if the file is over
+ */
+	enum TIEvent ev;
+
+	while((ev = nextEvent(rd, grp)) == TIE_NONE){
+		if(fillReader(rd) <= 0)
+			return TIE_NONE;
+	}
+	return ev;
+}
@@ -0,0 +1,111 @@
+/*
+ *	Reload.c
+ *		Apply a new configuration to running sections
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * On SIGHUP, the configuration file is read again in a fresh list of
+ * sections, checked and compiled exactly like at startup (see
+ * TeleInfod.c) : on any error, running sections are left untouched.
+ *
+ * Each new section is then handed to the running one of the same name
+ * through its "reload" pointer. Its reader swaps it in at the next frame
+ * boundary (STX) : ports, queues, spools, sinks and the broker connection
+ * are kept, no group is lost.
+ * As the scrape endpoint may still be walking the previous label set,
+ * replaced settings are stacked on "retired" and only freed at the next
+ * reload, once no scrape that may have seen them is running (RCU like,
+ * see metricsQuiesce()) : the reader never waits nor frees them.
+ *
+ * Only publishing settings are reloaded : Publish=, Topic=, ConvCons=,
+ * ConvProd=, FrameTopic=, Refresh=, Deadband=, KeyFrame= and Encoding=.
+ */
+
+#include <stdlib.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+#define SWAP(type, field) { type t = ctx->field; ctx->field = n->field; n->field = t; }
+
+void applyConfiguration(struct CSection *ctx){
+/* Reader side, at a frame boundary */
+	struct CSection *n = atomic_exchange_explicit(&ctx->reload, NULL, memory_order_acquire);
+	if(!n)
+		return;
+
+	SWAP(const char *, labels);
+	SWAP(const char *, topic);
+	SWAP(const char *, cctopic);
+	SWAP(const char *, cptopic);
+	SWAP(unsigned int, refresh);
+	SWAP(const char *, deadbands);
+	SWAP(const char *, frametopic);
+	SWAP(enum Encoding, encoding);
+	SWAP(unsigned int, keyframes);
+	SWAP(char *, batch);
+
+		/* Label sets are swapped last : the previous one is still
+		 * valid for other threads */
+	struct LabelSet *old = ctx->pub;
+	atomic_store_explicit(&ctx->pub, n->pub, memory_order_release);
+	n->pub = old;
+
+	ctx->batchlen = 0;
+	ctx->inframe = false;
+	ctx->nbbatch = 0;	/* starts with a key frame */
+
+	if(ctx->storedir)
+		closeColumns(old);
+
+	n->next = atomic_load_explicit(&ctx->retired, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&ctx->retired, &n->next, n, memory_order_release, memory_order_relaxed));
+
+	if(debug)
+		printf("*I* [%s] New configuration applied\n", ctx->name);
+}
+
+void freeConfiguration(struct CSection *n){
+/* Free a section that isn't running */
+	struct LabelSet *set = n->pub;
+
+	if(set){
+		for(unsigned int i=0; i<set->nb; i++){
+			struct PubLabel *pl = set->labels + i;
+			if(pl->flags & LF_OWNED)
+				cfgFree((void *)pl->name);
+			cfgFree(pl->topic.name);
+			cfgFree(pl->htopic.name);
+			cfgFree(pl->cptopic.name);
+			cfgFree(pl->cctopic.name);
+			cfgFree(pl->col);
+		}
+		cfgFree(set->labels);
+		cfgFree(set);
+	}
+
+	cfgFree((void *)n->name);
+	cfgFree((void *)n->port);
+	cfgFree((void *)n->labels);
+	cfgFree((void *)n->topic);
+	cfgFree((void *)n->cctopic);
+	cfgFree((void *)n->cptopic);
+	cfgFree((void *)n->deadbands);
+	cfgFree((void *)n->frametopic);
+	cfgFree((void *)n->spoolfile);
+	cfgFree((void *)n->storedir);
+	cfgFree((void *)n->snapshot);
+	freeSinks(n);
+	cfgFree(n->batch);
+	cfgFree(n);
+}
@@ -0,0 +1,188 @@
+/*
+ *	Serial.c
+ *		Serial port setup
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * When the port is a tty, it is configured directly (no more need of an
+ * external stty) : Baud= and Mode= (default 1200 7E1 for historic frames,
+ * 9600 7E1 for standard ones), raw input.
+ *
+ * ReadPolicy= selects how the kernel wakes the reader up :
+ * 	- batch:<vmin>:<vtime> (default batch:1:0) read() returns once vmin
+ * 	bytes are received or after vtime tenths of second of silence. Larger
+ * 	vmin means less wakeups, at the cost of freshness.
+ * 	- lowlatency : every byte wakes the reader up as soon as possible
+ * 	(and the UART driver is asked to not delay them).
+ * Other kinds of files (FIFO, regular files for tests) are left untouched.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#	include <linux/serial.h>
+#endif
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+static speed_t baudrate(unsigned int baud){
+	switch(baud){
+	case 1200: return B1200;
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	default: return B0;
+	}
+}
+
+bool checkBaud(unsigned int baud){
+	return baudrate(baud) != B0;
+}
+
+bool parseMode(struct CSection *s, const char *mode){
+/* Parse a "7E1" like mode
+ * <- false if invalid
+ */
+	if(strlen(mode) != 3 || mode[0] < '5' || mode[0] > '8' || !strchr("NEO", mode[1]) || (mode[2] != '1' && mode[2] != '2'))
+		return false;
+
+	s->databits = mode[0] - '0';
+	s->parity = mode[1];
+	s->stopbits = mode[2] - '0';
+	return true;
+}
+
+bool parseReadPolicy(struct CSection *s, const char *policy){
+/* Parse "lowlatency" or "batch[:vmin[:vtime]]"
+ * <- false if invalid
+ */
+	if(!strcmp(policy, "lowlatency")){
+		s->lowlatency = true;
+		s->vmin = 1;
+		s->vtime = 0;
+		return true;
+	}
+
+	const char *arg;
+	if(!(arg = striKWcmp((char *)policy, "batch")))
+		return false;
+
+	s->lowlatency = false;
+	s->vmin = 1;
+	s->vtime = 0;
+
+	if(*arg == ':'){
+		char *end;
+		long v = strtol(arg+1, &end, 10);
+		if(v < 1 || v > 255)
+			return false;
+		s->vmin = v;
+
+		if(*end == ':'){
+			v = strtol(end+1, &end, 10);
+			if(v < 0 || v > 255)
+				return false;
+			s->vtime = v;
+		}
+		if(*end)
+			return false;
+	} else if(*arg)
+		return false;
+
+	return true;
+}
+
+int openPort(struct CSection *s, bool nonblock){
+/* Open and configure section's port
+ * -> nonblock : the port will be multiplexed (see Engine.c)
+ * <- its file descriptor
+ */
+	int fd = open(s->port, O_RDONLY | O_NOCTTY | (nonblock ? O_NONBLOCK : 0));
+	if(fd == -1){
+		perror(s->port);
+		exit(EXIT_FAILURE);
+	}
+
+	if(!isatty(fd))
+		return fd;
+
+	struct termios tio;
+	if(tcgetattr(fd, &tio) == -1){
+		perror(s->port);
+		exit(EXIT_FAILURE);
+	}
+
+	cfmakeraw(&tio);
+
+	tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+	tio.c_cflag |= CREAD | CLOCAL;
+	switch(s->databits){
+	case 5: tio.c_cflag |= CS5; break;
+	case 6: tio.c_cflag |= CS6; break;
+	case 7: tio.c_cflag |= CS7; break;
+	default: tio.c_cflag |= CS8; break;
+	}
+	if(s->parity == 'E')
+		tio.c_cflag |= PARENB;
+	else if(s->parity == 'O')
+		tio.c_cflag |= PARENB | PARODD;
+	if(s->stopbits == 2)
+		tio.c_cflag |= CSTOPB;
+
+	if(s->parity != 'N')	/* Check parity */
+		tio.c_iflag |= INPCK;
+
+	tio.c_cc[VMIN] = s->vmin;
+	tio.c_cc[VTIME] = s->vtime;
+
+	cfsetispeed(&tio, baudrate(s->baud));
+	cfsetospeed(&tio, baudrate(s->baud));
+
+	if(tcsetattr(fd, TCSANOW, &tio) == -1){
+		perror(s->port);
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef TIOCGSERIAL
+	{
+		struct serial_struct ser;
+		if(!ioctl(fd, TIOCGSERIAL, &ser)){
+			if(s->lowlatency)
+				ser.flags |= ASYNC_LOW_LATENCY;
+			else
+				ser.flags &= ~ASYNC_LOW_LATENCY;
+			if(ioctl(fd, TIOCSSERIAL, &ser) && debug)
+				printf("*W* [%s] Can't change low latency flag\n", s->name);
+		}
+	}
+#endif
+
+	tcflush(fd, TCIFLUSH);
+
+	if(debug)
+		printf("*I* [%s] '%s' configured as %u %u%c%u, %s (VMIN %u, VTIME %u)\n",
+			s->name, s->port, s->baud, s->databits, s->parity, s->stopbits,
+			s->lowlatency ? "low latency" : "batch", s->vmin, s->vtime
+		);
+
+	return fd;
+}
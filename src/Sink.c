@@ -0,0 +1,460 @@
+/*
+ *	Sink.c
+ *		Additional outputs : InfluxDB line protocol over UDP, UNIX socket
+ *		or MQTT
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Besides the broker, a section's values can be fanned out to any number
+ * of Sink= (InfluxDB, Telegraf's socket_listener ...) :
+ *	Sink=udp:<host>:<port> [options]	datagrams
+ *	Sink=unix:<path> [options]		a stream socket TeleInfod connects to
+ *	Sink=mqtt:<topic> [options]		batches published by the broker's client
+ * Options :
+ *	measurement=<name>	(default "teleinfo")
+ *	batch=<bytes>		largest datagram or write (default 1400 / 8192 / 4096)
+ *	linger=<ms>			how long a line may wait to be sent with others
+ *						(default 0 : only lines already queued are grouped)
+ *	queue=<bytes>		sink's queue (default Queue_Size=)
+ *
+ * Each published value becomes a line
+ *	<measurement>,section=<name> <LABEL>=<value>[,<LABEL>_h=<horodate>] <ns>
+ * Values are typed as they are published (see encodeValue()) : numbers,
+ * status registers and dates are integers, texts and named periods
+ * (historic PTEC) strings ; horodates are epochs.
+ *
+ * The reader formats a line once, and pushes it in every sink's queue
+ * (the same ring as the broker's one, see Queue.c) : it never waits.
+ * Each sink has its own thread sending batches : a slow or unreachable
+ * sink only fills its own queue, then its lines are dropped and counted,
+ * other sinks and the broker aren't affected.
+ *
+ * Each kind of sink is an entry of sinkops[] : how to open it, send a
+ * batch and close it. A failed send loses its batch ; the sink is then
+ * closed and opened again every BRK_RECONNECT seconds, lines waiting
+ * queued meanwhile.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+struct SinkOps {
+	const char *scheme;		/* Sink=<scheme><address> */
+	size_t batch;			/* default largest write */
+	bool (*check)(const char *);	/* is address valid ? */
+	bool (*open)(struct Sink *);	/* <- false if it can't be used yet */
+	bool (*send)(struct Sink *, const char *, size_t);	/* a batch, <- false if lost */
+	void (*close)(struct Sink *);	/* after a failed send (NULL : nothing to do) */
+};
+
+static const char *address(const struct Sink *sk){
+	return sk->target + strlen(sk->ops->scheme);
+}
+
+static void sinkError(struct Sink *sk, const char *msg){
+/* Reported once per outage */
+	if(!sk->failing || debug)
+		fprintf(stderr, "*E* Sink '%s' : %s\n", sk->target, msg);
+	sk->failing = true;
+}
+
+static void closeSocket(struct Sink *sk){
+	close(sk->fd);
+	sk->fd = -1;
+}
+
+	/* UDP datagrams */
+static bool checkUDP(const char *addr){
+	const char *port = strrchr(addr, ':');
+	return port && port != addr && port[1];
+}
+
+static bool openUDP(struct Sink *sk){
+	const char *addr = address(sk);
+	const char *port = strrchr(addr, ':');
+	char host[port - addr + 1];
+	struct addrinfo hints, *res;
+	int err;
+
+	memcpy(host, addr, port - addr);
+	host[port - addr] = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if((err = getaddrinfo(host, port + 1, &hints, &res))){
+		sinkError(sk, gai_strerror(err));
+		return false;
+	}
+
+	if((sk->fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) < 0
+	|| connect(sk->fd, res->ai_addr, res->ai_addrlen) < 0){
+		sinkError(sk, strerror(errno));
+		if(sk->fd >= 0)
+			closeSocket(sk);
+		freeaddrinfo(res);
+		return false;
+	}
+	freeaddrinfo(res);
+	return true;
+}
+
+static bool sendDatagram(struct Sink *sk, const char *b, size_t len){
+	if(send(sk->fd, b, len, 0) >= 0)
+		return true;
+	sinkError(sk, strerror(errno));
+	return false;
+}
+
+	/* UNIX stream socket */
+static bool checkUNIX(const char *path){
+	return *path && strlen(path) < sizeof(((struct sockaddr_un *)NULL)->sun_path);
+}
+
+static bool openUNIX(struct Sink *sk){
+	struct sockaddr_un addr;
+	struct timeval tv = { SINK_TIMEOUT, 0 };
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, address(sk));
+
+	if((sk->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0){
+		sinkError(sk, strerror(errno));
+		return false;
+	}
+	if(connect(sk->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		sinkError(sk, strerror(errno));
+		closeSocket(sk);
+		return false;
+	}
+	setsockopt(sk->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if(debug)
+		printf("*I* Sink '%s' connected\n", sk->target);
+	return true;
+}
+
+static bool sendStream(struct Sink *sk, const char *b, size_t len){
+/* a partial write would cut a line : the stream is restarted */
+	while(len){
+		ssize_t r = send(sk->fd, b, len, MSG_NOSIGNAL);
+		if(r <= 0){
+			sinkError(sk, r ? strerror(errno) : "connection closed");
+			return false;
+		}
+		b += r;
+		len -= r;
+	}
+	return true;
+}
+
+	/* MQTT : the client publishing to the broker */
+static bool checkMQTT(const char *topic){
+	return *topic;
+}
+
+static bool openMQTT(struct Sink *sk){
+	return brokerConnected();
+}
+
+static bool sendMQTT(struct Sink *sk, const char *b, size_t len){
+	return papubSecondary(address(sk), len, (void *)b, 0) >= 0;
+}
+
+static const struct SinkOps sinkops[] = {
+	{ "udp:", SINK_UDP_BATCH, checkUDP, openUDP, sendDatagram, closeSocket },
+	{ "unix:", SINK_UNIX_BATCH, checkUNIX, openUNIX, sendStream, closeSocket },
+	{ "mqtt:", SINK_MQTT_BATCH, checkMQTT, openMQTT, sendMQTT, NULL },
+	{ NULL }
+};
+
+bool parseSink(struct CSection *s, const char *arg){
+/* Add a sink to a section
+ * -> arg : Sink= argument
+ * <- false if it is invalid
+ */
+	char spec[strlen(arg) + 1];
+	char *tok, *sp;
+	struct Sink *sk;
+
+	strcpy(spec, arg);
+	if(!(tok = strtok_r(spec, " \t", &sp)))
+		return false;
+
+	assert( (sk = cfgCalloc(1, sizeof(struct Sink))) );
+	sk->fd = -1;
+
+	for(sk->ops = sinkops; sk->ops->scheme; sk->ops++)
+		if(!strncmp(tok, sk->ops->scheme, strlen(sk->ops->scheme)))
+			break;
+	if(!sk->ops->scheme || !sk->ops->check(tok + strlen(sk->ops->scheme)))
+		goto bad;
+	sk->batch = sk->ops->batch;
+	assert( (sk->target = cfgStrdup(tok)) );
+
+	while((tok = strtok_r(NULL, " \t", &sp))){
+		char *v;
+		if((v = striKWcmp(tok, "measurement=")) && *v)
+			assert( (sk->measurement = cfgStrdup(v)) );
+		else if((v = striKWcmp(tok, "batch=")) && atoi(v) > 0)
+			sk->batch = atoi(v);
+		else if((v = striKWcmp(tok, "linger=")))
+			sk->linger = atoi(v);
+		else if((v = striKWcmp(tok, "queue=")))
+			sk->queuesz = atoi(v);
+		else
+			goto bad;
+	}
+	if(!sk->measurement)
+		assert( (sk->measurement = cfgStrdup(SINK_MEASUREMENT)) );
+
+		/* Kept in configuration's order */
+	struct Sink **last = &s->sinks;
+	while(*last)
+		last = &(*last)->next;
+	*last = sk;
+	return true;
+
+bad:
+	cfgFree((void *)sk->target);
+	cfgFree((void *)sk->measurement);
+	cfgFree(sk);
+	return false;
+}
+
+void freeSinks(struct CSection *s){
+/* Sinks of a section that isn't running */
+	struct Sink *sk;
+
+	while((sk = s->sinks)){
+		s->sinks = sk->next;
+		cfgFree((void *)sk->target);
+		cfgFree((void *)sk->measurement);
+		cfgFree(sk);
+	}
+}
+
+static size_t escapeKey(char *d, const char *s){
+/* Measurement or tag, escaped as line protocol requires
+ * <- bytes written
+ */
+	char *p = d;
+	for(; *s; s++){
+		if(*s == ',' || *s == ' ' || *s == '=')
+			*p++ = '\\';
+		*p++ = *s;
+	}
+	*p = 0;
+	return p - d;
+}
+
+void initSinks(struct CSection *s, size_t queuesz){
+/* -> queuesz : default queue's size */
+	for(struct Sink *sk = s->sinks; sk; sk = sk->next){
+		char prefix[2 * (strlen(sk->measurement) + strlen(s->name)) + 16];
+		size_t len = escapeKey(prefix, sk->measurement);
+		len += sprintf(prefix + len, ",section=");
+		len += escapeKey(prefix + len, s->name);
+		prefix[len++] = ' ';
+		prefix[len] = 0;
+
+		assert( (sk->prefix = cfgStrdup(prefix)) );
+		sk->prefixlen = len;
+
+		initQueue(&sk->queue, sk->queuesz ? sk->queuesz : queuesz);
+		assert( (sk->buf = cfgAlloc(sk->batch + len + SINK_LINE)) );
+		sk->buflen = 0;
+		sk->buflines = 0;
+		atomic_init(&sk->writes, 0);
+		atomic_init(&sk->lost, 0);
+		assert(!sem_init(&sk->pending, 0, 0));
+		sk->up = false;	/* opened by its thread */
+
+		if(debug)
+			printf("*I* [%s] Sink '%s' (batch %lu bytes, linger %u ms)\n", s->name, sk->target, (unsigned long)sk->batch, sk->linger);
+	}
+}
+
+void sinkValue(struct CSection *ctx, struct PubLabel *pl){
+/* Send a published value to section's sinks (reader side) */
+	const struct TIValue *v = &pl->value;
+	int64_t now = nowUS();
+	char line[SINK_LINE];
+	char *p = line;
+
+	p += sprintf(p, "%s=", pl->name);
+	if(v->valid && (pl->type == VT_DATE || pl->type == VT_BITS || !(pl->flags & LF_RAW)))
+		p += sprintf(p, "%llui", (unsigned long long)v->num);
+	else {
+		*p++ = '"';
+		for(const char *t = v->text; *t; t++){
+			if(*t == '"' || *t == '\\')
+				*p++ = '\\';
+			*p++ = *t;
+		}
+		*p++ = '"';
+	}
+	if(v->stamp && pl->type != VT_DATE)
+		p += sprintf(p, ",%s_h=%lldi", pl->name, (long long)v->stamp);
+	p += sprintf(p, " %lld000", (long long)now);
+
+	for(struct Sink *sk = ctx->sinks; sk; sk = sk->next){
+		size_t h;
+		struct QRecord *r = qreserve(&sk->queue, "", 1, p - line, line, &h);
+		if(!r){
+			if(!atomic_fetch_add_explicit(&sk->queue.dropped, 1, memory_order_relaxed) || debug)
+				fprintf(stderr, "*W* [%s] Sink '%s' queue full : line dropped\n", ctx->name, sk->target);
+			continue;
+		}
+		r->retained = 0;
+		r->age = 0;
+		r->stamp = now;
+		qcommit(&sk->queue, h);
+		sem_post(&sk->pending);
+	}
+}
+
+	/* **
+	 * Sink's thread
+	 * **/
+
+static void flush(struct Sink *sk){
+/* Send the batch being built */
+	if(sk->ops->send(sk, sk->buf, sk->buflen))
+		atomic_fetch_add_explicit(&sk->writes, 1, memory_order_relaxed);
+	else {
+		if(!atomic_fetch_add_explicit(&sk->lost, sk->buflines, memory_order_relaxed) || debug)
+			fprintf(stderr, "*W* Sink '%s' : %u line(s) lost\n", sk->target, sk->buflines);
+		if(sk->ops->close)
+			sk->ops->close(sk);
+		sk->up = false;
+	}
+
+	sk->buflen = 0;
+	sk->buflines = 0;
+}
+
+static int64_t drainSink(struct Sink *sk, int64_t first){
+/* Move queued lines in batches
+ * -> first : when the oldest line of the current batch has been taken
+ * <- its updated value
+ */
+	struct PubQueue *q = &sk->queue;
+	unsigned int nb = 0;
+	uint64_t delays = 0;
+	int64_t now = nowUS();
+	size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t h = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	while(t != h){
+		size_t pos = t & (q->size - 1);
+		struct QRecord *r = (struct QRecord *)(q->ring + pos);
+
+		if(!r->tlen){	/* padding */
+			t += q->size - pos;
+			continue;
+		}
+
+		if(sk->buflen && sk->buflen + sk->prefixlen + r->plen + 1 > sk->batch){
+			flush(sk);
+			if(!sk->up)	/* Lost : remaining lines wait until it is opened again */
+				break;
+		}
+		if(!sk->buflen)
+			first = now;
+
+		memcpy(sk->buf + sk->buflen, sk->prefix, sk->prefixlen);
+		sk->buflen += sk->prefixlen;
+		memcpy(sk->buf + sk->buflen, (const char *)(r + 1) + r->tlen, r->plen);
+		sk->buflen += r->plen;
+		sk->buf[sk->buflen++] = '\n';
+		sk->buflines++;
+
+		if(now > r->stamp)
+			delays += now - r->stamp;
+		nb++;
+
+		t += QALIGN(sizeof(struct QRecord) + r->tlen + r->plen);
+		atomic_store_explicit(&q->tail, t, memory_order_release);
+	}
+
+	if(nb){
+		atomic_fetch_add_explicit(&q->latency, delays, memory_order_relaxed);
+		atomic_fetch_add_explicit(&q->published, nb, memory_order_release);
+	}
+	return first;
+}
+
+static void *sinkThread(void *actx){
+	struct Sink *sk = actx;
+	int64_t first = 0;		/* oldest line of the batch (µs since epoch) */
+	time_t lastopen = 0;	/* last opening attempt */
+	struct timespec ts;
+
+	for(;;){
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if(sk->buflen){	/* wake up when the batch has to go */
+			int64_t due = first + sk->linger * 1000LL - nowUS();
+			if(due > 0){
+				ts.tv_sec += due / 1000000;
+				ts.tv_nsec += (due % 1000000) * 1000;
+				if(ts.tv_nsec >= 1000000000){
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+			}
+		} else
+			ts.tv_sec++;
+		sem_timedwait(&sk->pending, &ts);
+
+		if(!sk->up){	/* Lines are kept queued meanwhile */
+			time_t now = time(NULL);
+			if(now - lastopen < BRK_RECONNECT)
+				continue;
+			lastopen = now;
+			if(!(sk->up = sk->ops->open(sk)))
+				continue;
+			sk->failing = false;
+		}
+
+		first = drainSink(sk, first);
+		if(sk->buflen && sk->up && nowUS() - first >= sk->linger * 1000LL)
+			flush(sk);
+	}
+
+	return NULL;
+}
+
+void startSinks(struct CSection *sections){
+	pthread_attr_t thread_attr;
+	pthread_t thread;
+
+	initThreadAttr(&thread_attr);
+
+	for(struct CSection *s = sections; s; s = s->next)
+		for(struct Sink *sk = s->sinks; sk; sk = sk->next)
+			if(pthread_create( &thread, &thread_attr, sinkThread, sk)){
+				fputs("*F* Can't create a sink's thread\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+}
@@ -0,0 +1,111 @@
+/*
+ *	Snapshot.c
+ *		Share sections' latest values with local processes
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Consumers on the same host (load shedding, displays ...) don't need a
+ * broker round trip : with Snapshot=, the reader's thread copies its
+ * section's published labels in a shared memory segment at every ETX
+ * (layout and reader side in Snapshot.h).
+ * The copy is done under a sequence lock, as for the in-process
+ * snapshot (see Decode.c) : it never waits for readers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+#include "Snapshot.h"
+
+_Static_assert(TISNAP_FIELDS >= LABELS_MAX, "a label set doesn't fit in a snapshot");
+_Static_assert(TISNAP_LABEL > LABEL_MAX, "labels don't fit in a snapshot");
+_Static_assert(TISNAP_TEXT > VALUE_MAX, "values don't fit in a snapshot");
+_Static_assert(TISNAP_DATE == VT_DATE, "snapshot's types don't match ValueType");
+
+void initSnapshot(struct CSection *s){
+/* Create (or take over) section's segment */
+	int fd = shm_open(s->snapshot, O_RDWR | O_CREAT, 0644);
+	if(fd == -1){
+		perror(s->snapshot);
+		exit(EXIT_FAILURE);
+	}
+
+	if(ftruncate(fd, sizeof(struct TISnapshot)) == -1){
+		perror(s->snapshot);
+		exit(EXIT_FAILURE);
+	}
+
+	struct TISnapshot *sh = mmap(NULL, sizeof(struct TISnapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(sh == MAP_FAILED){
+		perror(s->snapshot);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+		/* Readers of a previous run may still be there */
+	uint32_t seq = (atomic_load_explicit(&sh->seq, memory_order_relaxed) + 1) | 1;
+	atomic_store_explicit(&sh->seq, seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memset(sh->fields, 0, sizeof(sh->fields));
+	sh->magic = TISNAP_MAGIC;
+	sh->version = TISNAP_VERSION;
+	sh->fieldsz = sizeof(struct TISnapField);
+	sh->nbfields = 0;
+	sh->pid = getpid();
+	sh->frames = 0;
+	sh->updated = 0;
+	strncpy(sh->section, s->name, sizeof(sh->section) - 1);
+	sh->section[sizeof(sh->section) - 1] = 0;
+
+	atomic_store_explicit(&sh->seq, seq + 1, memory_order_release);
+	s->snap = sh;
+
+	if(debug)
+		printf("*I* [%s] Snapshot in shared memory '%s'\n", s->name, s->snapshot);
+}
+
+void snapshotFrame(struct CSection *ctx){
+/* A frame is complete : copy its values (reader's thread)
+ * Values of interrupted frames are never applied (see Decode.c)
+ */
+	struct TISnapshot *sh = ctx->snap;
+	struct LabelSet *set = ctx->pub;
+	uint32_t seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for(unsigned int i=0; i<set->nb; i++){	/* Indexes are labels' ones */
+		const struct PubLabel *pl = set->labels + i;
+		struct TISnapField *f = sh->fields + i;
+
+		strncpy(f->label, pl->name, TISNAP_LABEL - 1);
+		f->type = pl->type;
+		f->valid = pl->value.valid;
+		f->len = pl->value.len;
+		f->num = pl->value.num;
+		f->stamp = pl->value.stamp;
+		f->received = pl->value.received;
+		memcpy(f->text, pl->value.text, pl->value.len + 1);
+	}
+	sh->nbfields = set->nb;
+	sh->frames++;
+	sh->updated = ctx->rd.frame.end.real;
+
+	atomic_store_explicit(&sh->seq, seq + 2, memory_order_release);
+}
@@ -0,0 +1,177 @@
+/*
+ * Snapshot.h
+ * 	Latest values of a TeleInfod section, shared with local processes
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * With Snapshot=<name>, a section's published labels are copied at the
+ * end of every complete frame in the POSIX shared memory segment <name>
+ * (/dev/shm/<name>). Its layout is fixed : each label keeps its index
+ * as long as the configuration isn't reloaded.
+ *
+ * This header is all a consumer needs (link with -lrt on old libc) :
+ *
+ *	const struct TISnapshot *s = tisnapOpen("/teleinfo");
+ *	struct TISnapField f;
+ *	if(s && tisnapValue(s, "SINSTS", &f) && f.valid)
+ *		printf("%llu VA\n", (unsigned long long)f.num);
+ *
+ * Writes are protected by a sequence lock : readers never block
+ * TeleInfod, nor do any syscall, they only retry if they raced with an
+ * update.
+ */
+
+#ifndef TISNAPSHOT_H
+#define TISNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TISNAP_MAGIC	0x54494e53	/* "TINS" */
+#define TISNAP_VERSION	1
+
+#define TISNAP_FIELDS	128	/* Labels in a segment */
+#define TISNAP_LABEL	12	/* Label's room (9 char max) */
+#define TISNAP_TEXT		104	/* Value's room */
+
+	/* Values' types */
+#define TISNAP_STRING	0	/* text only */
+#define TISNAP_U32		1	/* numeric */
+#define TISNAP_U64		2	/* energy counter */
+#define TISNAP_ENUM		3	/* tariff period (NTARF, PTEC) */
+#define TISNAP_BITS		4	/* status register (STGE) */
+#define TISNAP_DATE		5	/* horodate only (DATE) */
+
+struct TISnapField {
+	char label[TISNAP_LABEL];	/* '\0' terminated */
+	uint8_t type;			/* TISNAP_* */
+	uint8_t valid;			/* num is meaningful */
+	uint8_t len;			/* text's length */
+	uint8_t reserved;
+	uint64_t num;			/* decoded value ; epoch of a DATE */
+	int64_t stamp;			/* horodate (epoch seconds), 0 if none */
+	int64_t received;		/* epoch seconds, 0 : never received */
+	char text[TISNAP_TEXT];	/* as published, '\0' terminated */
+};
+
+struct TISnapshot {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t fieldsz;		/* sizeof(struct TISnapField) */
+	_Atomic uint32_t seq;	/* odd while being updated */
+	uint32_t nbfields;		/* fields in use */
+	int32_t pid;			/* TeleInfod's */
+	uint32_t reserved;
+	uint64_t frames;		/* complete frames copied */
+	int64_t updated;		/* last frame's reception (ETX, µs since epoch) */
+	char section[32];
+	struct TISnapField fields[TISNAP_FIELDS];
+};
+
+	/* **
+	 * Reader side
+	 * **/
+
+static inline const struct TISnapshot *tisnapOpen(const char *name){
+/* Map a segment read only
+ * <- NULL if it doesn't exist or isn't compatible (errno is set)
+ */
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd == -1)
+		return NULL;
+
+	void *m = mmap(NULL, sizeof(struct TISnapshot), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+		return NULL;
+
+	const struct TISnapshot *s = (const struct TISnapshot *)m;
+	if(s->magic != TISNAP_MAGIC || s->version != TISNAP_VERSION || s->fieldsz != sizeof(struct TISnapField)){
+		munmap(m, sizeof(struct TISnapshot));
+		errno = EPROTO;
+		return NULL;
+	}
+	return s;
+}
+
+static inline void tisnapClose(const struct TISnapshot *s){
+	munmap((void *)s, sizeof(struct TISnapshot));
+}
+
+static inline uint32_t tisnapBegin(const struct TISnapshot *s){
+/* Wait for a stable snapshot
+ * <- sequence to check with tisnapRetry()
+ */
+	uint32_t seq;
+	while((seq = atomic_load_explicit((_Atomic uint32_t *)&s->seq, memory_order_acquire)) & 1);
+	return seq;
+}
+
+static inline bool tisnapRetry(const struct TISnapshot *s, uint32_t seq){
+/* <- true if TeleInfod updated the snapshot while it was read */
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit((_Atomic uint32_t *)&s->seq, memory_order_relaxed) != seq;
+}
+
+static inline int tisnapFind(const struct TISnapshot *s, const char *label){
+/* <- label's index or -1 if not published */
+	for(unsigned int i=0; i<TISNAP_FIELDS && i<s->nbfields; i++)
+		if(!strncmp(s->fields[i].label, label, TISNAP_LABEL))
+			return i;
+	return -1;
+}
+
+static inline uint32_t tisnapGet(const struct TISnapshot *s, int idx, struct TISnapField *f){
+/* Consistent copy of a field
+ * <- its frame's sequence (2 values from the same frame have the same)
+ */
+	uint32_t seq;
+	do {
+		seq = tisnapBegin(s);
+		memcpy(f, &s->fields[idx], sizeof(struct TISnapField));
+	} while(tisnapRetry(s, seq));
+	return seq;
+}
+
+static inline bool tisnapValue(const struct TISnapshot *s, const char *label, struct TISnapField *f){
+/* Consistent copy of a label's field
+ * <- false if not published or never received
+ */
+	for(;;){
+		int idx = tisnapFind(s, label);
+		if(idx < 0)
+			return false;
+		tisnapGet(s, idx, f);
+		if(!strncmp(f->label, label, TISNAP_LABEL))
+			return f->received != 0;
+			/* The configuration has been reloaded meanwhile */
+	}
+}
+
+static inline uint32_t tisnapCopy(const struct TISnapshot *s, struct TISnapshot *dst){
+/* Consistent copy of a whole frame */
+	uint32_t seq;
+	do {
+		seq = tisnapBegin(s);
+		memcpy(dst, s, sizeof(struct TISnapshot));
+	} while(tisnapRetry(s, seq));
+	return seq;
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ *	Spool.c
+ *		Store and forward messages during broker outages
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * When Spool= is set for a section, messages that can't be published
+ * are appended to this memory mapped file, and replayed in order when
+ * the broker is back. Until the spool is empty, live messages are
+ * appended behind the backlog, so a topic never gets an older value
+ * after a newer one. Each live message spooled that way is replayed on
+ * top of Replay_Rate= messages per second : the backlog always drains,
+ * whatever the live rate.
+ * Records are stored verbatim (topic, payload as built from the frame,
+ * queueing time and reception delay). With MQTT 5, replayed messages
+ * carry their reception time as a "ts" user property (epoch seconds).
+ *
+ * The file is a ring of Spool_Size= bytes behind a small header and
+ * survives a daemon restart. When it is full, oldest records are lost.
+ * Only the publisher thread touches spools : no locking needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+#define SPOOL_MAGIC "TISPOOL1"
+
+struct SpoolHeader {
+	char magic[8];
+	uint64_t size;		/* data area's size */
+	uint64_t head;		/* free running write counter */
+	uint64_t tail;		/* free running read counter */
+};
+
+void initSpool(struct CSection *s, size_t size){
+/* Open (or create) section's spool file
+ * -> size : data area's size, rounded up to a power of 2
+ */
+	struct Spool *sp = &s->spool;
+	size_t sz = 4096;
+	while(sz < size)
+		sz <<= 1;
+
+	int fd = open(s->spoolfile, O_RDWR | O_CREAT, 0640);
+	if(fd == -1){
+		perror(s->spoolfile);
+		exit(EXIT_FAILURE);
+	}
+
+	if(ftruncate(fd, sizeof(struct SpoolHeader) + sz) == -1){
+		perror(s->spoolfile);
+		exit(EXIT_FAILURE);
+	}
+
+	void *m = mmap(NULL, sizeof(struct SpoolHeader) + sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(m == MAP_FAILED){
+		perror(s->spoolfile);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	sp->hdr = m;
+	sp->data = (char *)m + sizeof(struct SpoolHeader);
+
+	if(memcmp(sp->hdr->magic, SPOOL_MAGIC, 8) || sp->hdr->size != sz){	/* New or resized spool */
+		if(sp->hdr->size && debug)
+			printf("*W* [%s] Spool '%s' reinitialised\n", s->name, s->spoolfile);
+		memcpy(sp->hdr->magic, SPOOL_MAGIC, 8);
+		sp->hdr->size = sz;
+		sp->hdr->head = sp->hdr->tail = 0;
+	} else if(sp->hdr->head != sp->hdr->tail && debug)
+		printf("*I* [%s] %lu bytes pending in spool\n", s->name, (unsigned long)(sp->hdr->head - sp->hdr->tail));
+}
+
+bool spoolEmpty(struct CSection *s){
+	return(!s->spoolfile || s->spool.hdr->head == s->spool.hdr->tail);
+}
+
+static void spoolSkip(struct Spool *sp){
+/* Remove the oldest record */
+	size_t pos = sp->hdr->tail & (sp->hdr->size - 1);
+	struct QRecord *r = (struct QRecord *)(sp->data + pos);
+
+	if(!r->tlen)	/* padding */
+		sp->hdr->tail += sp->hdr->size - pos;
+	else
+		sp->hdr->tail += QALIGN(sizeof(struct QRecord) + r->tlen + r->plen);
+}
+
+void spoolAppend(struct CSection *s, const struct QRecord *r){
+/* Store a record waiting for the broker */
+	struct Spool *sp = &s->spool;
+	size_t need = QALIGN(sizeof(struct QRecord) + r->tlen + r->plen);
+	size_t sz = sp->hdr->size;
+
+	if(need > sz)
+		return;
+
+	size_t pos = sp->hdr->head & (sz - 1);
+	size_t pad = (pos + need > sz) ? sz - pos : 0;
+
+	while(need + pad > sz - (sp->hdr->head - sp->hdr->tail)){	/* Make room */
+		if(!sp->lost++ || debug)
+			fprintf(stderr, "*W* [%s] Spool full : oldest message lost\n", s->name);
+		spoolSkip(sp);
+	}
+
+	if(pad){
+		((struct QRecord *)(sp->data + pos))->tlen = 0;
+		sp->hdr->head += pad;
+		pos = 0;
+	}
+
+	memcpy(sp->data + pos, r, sizeof(struct QRecord) + r->tlen + r->plen);
+	sp->hdr->head += need;
+}
+
+unsigned int spoolReplay(struct CSection *s, unsigned int max){
+/* Publish spooled records
+ * -> max : maximum number of records to send
+ * <- number of records sent
+ */
+	struct Spool *sp = &s->spool;
+	unsigned int nb = 0;
+
+	while(nb < max && sp->hdr->head != sp->hdr->tail){
+		size_t pos = sp->hdr->tail & (sp->hdr->size - 1);
+		struct QRecord *r = (struct QRecord *)(sp->data + pos);
+
+		if(r->tlen){
+			const char *topic = (const char *)(r + 1);
+			struct PubTrack track = { NULL, 0, 0, r->stamp - r->age };	/* Not accounted, keeps its reception */
+			if(papub(topic, r->plen, (void *)(topic + r->tlen), r->retained, &track) < 0)
+				break;	/* Broker lost again */
+			nb++;
+		}
+		spoolSkip(sp);
+	}
+
+	if(nb && debug)
+		printf("*d* [%s] %u message(s) replayed, %lu bytes remaining\n", s->name, nb, (unsigned long)(sp->hdr->head - sp->hdr->tail));
+	return nb;
+}
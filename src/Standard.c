@@ -17,174 +17,183 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "TeleInfod.h"
 #include "Config.h"
 
-void *process_standard(void *actx){
-	struct CSection *ctx = actx;	/* Only to avoid zillions of cast */
-	FILE *fframe;
+	/* Standard labels converted to their historic counterpart */
+static const struct Conversion {
+	const char *label;
+	const char *target;
+} prodconv[] = {	/* ConvProd= */
+	{ "SINSTI", "PAPP" },
+	{ "IRMS1", "IINST" },
+	{ "EAIT", "BASE" },
+	{ "SMAXIN", "IMAX" },
+	{ NULL, NULL }
+}, consconv[] = {	/* ConvCons= */
+	{ "SINSTS", "PAPP" },
+	{ "IRMS1", "IINST" },
+	{ "EASF02", "HCHP" },
+	{ "EASF01", "HCHC" },
+	{ "NTARF", "PTEC" },
+/*
+Il faut sans doute jouer avec NGTF, LTARF et les index EASF01 et EASF02
+A voir avec une vraie trame.
 
-			/* Target topics */
+	{ "????", "HHPHC" },
+*/
+	{ NULL, NULL }
+};
+
+static const char *convert(const struct Conversion *conv, const char *label){
+	for(; conv->label; conv++)
+		if(!strcmp(label, conv->label))
+			return conv->target;
+	return NULL;
+}
 
-		/* Main */
-	int sz = ctx->topic ? strlen(ctx->topic):0;	/* Size of its root */
-	char topic[sz + 16]; /* topic + '/h' */
-	if(sz){
-		strcpy(topic, ctx->topic);
-		topic[sz++] = '/';
-	}
+void initStandard(struct CSection *ctx){
+/* Build topics of labels to publish */
+	struct LabelSet *set = ctx->pub;
+
+	tzset();	/* Horodates' mktime() mustn't load the timezone once running */
+
+	for(unsigned int i=0; i<set->nb; i++){
+		struct PubLabel *pl = set->labels + i;
+		const char *target;
+
+		buildTopic(&pl->topic, ctx->topic, pl->name, NULL);
+		buildTopic(&pl->htopic, ctx->topic, pl->name, "/h");
 
-		/* Converted producer */
-	int szcp = ctx->cptopic ? strlen(ctx->cptopic):0;
-	char cptopic[szcp + 14];
-	if(szcp){
-		strcpy(cptopic, ctx->cptopic);
-		cptopic[szcp++] = '/';
+		if((target = convert(prodconv, pl->name)))
+			buildTopic(&pl->cptopic, ctx->cptopic, target, NULL);
+		else
+			buildTopic(&pl->cptopic, NULL, NULL, NULL);
+
+		if((target = convert(consconv, pl->name))){
+			buildTopic(&pl->cctopic, ctx->cctopic, target, NULL);
+			if(!strcmp(target, "PTEC"))
+				pl->flags |= LF_PTEC;
+		} else
+			buildTopic(&pl->cctopic, NULL, NULL, NULL);
 	}
+}
 
-		/* Converted Consumer */
-	int szcc = ctx->cctopic ? strlen(ctx->cctopic):0;
-	char cctopic[szcc + 14];
-	if(szcc){
-		strcpy(cctopic, ctx->cctopic);
-		cctopic[szcc++] = '/';
+static void publishValue(struct CSection *ctx, struct PubLabel *pl){
+/* Apply and publish a value of the completed frame */
+	struct TIValue *v = &pl->value;
+	const char *hd = pl->dated ? pl->hd : NULL;
+
+	applyValue(pl);
+	if(ctx->storedir)
+		storeValue(ctx, pl);
+
+	bool changed = valueChanged(ctx, pl);
+	if(changed || ctx->keyframes)	/* Key frames need all values */
+		batchAdd(ctx, pl, hd);
+	if(!changed)	/* Nothing new */
+		return;
+	if(ctx->sinks)
+		sinkValue(ctx, pl);
+
+	const char *payload = v->text;
+	size_t len = v->len;
+	char buf[VALUE_MAX + 16];
+
+	if(ctx->encoding != ENC_TEXT){
+		len = encodeValue(ctx->encoding, buf, pl);
+		payload = buf;
 	}
 
-	if(debug)
-		printf("Launching a processing historic for '%s'\n", ctx->name);
+	if(pl->topic.name){
+		if(debug){
+			if(hd)
+				printf("*d* [%s] Publishing '%s' : '%s' '%s'\n", ctx->name, pl->topic.name, hd, v->text);
+			else
+				printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, pl->topic.name, v->text);
+		}
+		qpublish(ctx, pl->topic.name, pl->topic.len, len, payload, 0);
+		if(hd){
+			if(ctx->encoding != ENC_TEXT && v->stamp){
+				char ts[16];
+				qpublish(ctx, pl->htopic.name, pl->htopic.len, encodeStamp(ctx->encoding, ts, v->stamp), ts, 0);
+			} else
+				qpublish(ctx, pl->htopic.name, pl->htopic.len, pl->hlen, hd, 0);
+		}
+	}
 
-	char buffer[256];	/* the largest field content seems arount 120 ... but as there is no standard limit ... */
-	
-	if(!(fframe = fopen(ctx->port, "r" ))){
-		perror(ctx->port);
-		exit(EXIT_FAILURE);
+	if(pl->cptopic.name){
+		if(debug)
+			printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, pl->cptopic.name, v->text);
+		qpublish(ctx, pl->cptopic.name, pl->cptopic.len, len, payload, 0);
 	}
+	if(pl->cctopic.name){
+		const char *dt = v->text;
+
+		if(pl->flags & LF_PTEC){
+			payload = dt = (v->num > 1) ? "HP..":"HC..";
+			len = 4;
+			if(ctx->encoding != ENC_TEXT){
+				len = encodeText(ctx->encoding, buf, dt, len);
+				payload = buf;
+			}
+		}
 
-	while(getLabel(fframe, buffer, 0x09)){	/* Reading data */
-		if(strstr(ctx->labels, buffer)){	/* Found in topic to publish */
-			bool cpfound = false;	/* Found a topic to be converted for producer */
-			bool ccfound = false;	/* Found a topic to be converted for consumer */
-			bool ptec = false;		/* We have to convert PTEC */
+		if(debug)
+			printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, pl->cctopic.name, dt);
+		qpublish(ctx, pl->cctopic.name, pl->cctopic.len, len, payload, 0);
+	}
+}
 
-#if 0
-			bool round = false;		/* Value to be rounded */
+void handleStandard(struct CSection *ctx, enum TIEvent ev, struct TIGroup *grp){
+/* Process an event read from the stream
+ * Values are held until the frame is complete (see Decode.c)
+ */
+#ifdef LATENCY_STATS
+	latencyParsed(ctx);
 #endif
 
-			bool horodate = (bool) strstr(	/* Include horodatage */
-				"SMAXSN,SMAXSN1,SMAXSN2,SMAXSN3,"
-				"SMAXSN-1,SMAXSN1-1,SMAXSN2-1,SMAXSN3-1,"
-				"SMAXIN,SMAXIN-1,"
-				"CCASN,CCASN-1,CCAIN,CCAIN-1"
-				",UMOY1,UMOY2,UMOY3,"
-				"DPM1,FPM1,DPM2,FPM2,DPM3,FPM3"
-			, buffer);
-
-			bool raw = (bool) strstr(	/* Non numeric values */
-				"ADSC,VTIC,DATE,NGTF,LTARF,STGE,MSG1,MSG2,PRM,RELAIS"
-			, buffer);
-
-			if(sz)	/* Full topic name */
-				strcpy(topic + sz, buffer);
-			if(szcp){
-				cpfound = true;
-				if(!strcmp(buffer,"SINSTI")){
-					strcpy(cptopic + szcp, "PAPP");
-/*					round = true;	*/
-				} else if(!strcmp(buffer,"SINSTI"))
-					strcpy(cptopic + szcp, "IINST");
-				else if(!strcmp(buffer,"EAIT"))
-					strcpy(cptopic + szcp, "BASE");
-				else if(!strcmp(buffer,"SMAXIN"))
-					strcpy(cptopic + szcp, "IMAX");
-				else
-					cpfound = false;
-			}
-			if(szcc){
-				ccfound = true;
-				if(!strcmp(buffer,"SINSTS")){
-					strcpy(cctopic + szcc, "PAPP");
-/*					round = true;	*/
-				} else if(!strcmp(buffer,"IRMS1"))
-					strcpy(cctopic + szcc, "IINST");
-				else if(!strcmp(buffer,"EASF02"))
-					strcpy(cctopic + szcc, "HCHP");
-				else if(!strcmp(buffer,"EASF01"))
-					strcpy(cctopic + szcc, "HCHC");
-				else if(!strcmp(buffer,"NTARF")){
-					strcpy(cctopic + szcc, "PTEC");
-					ptec = true;
-				}
-/*
-Il faut sans doute jouer avec NGTF, LTARF et les index EASF01 et EASF02
-A voir avec une vraie trame.
+	if(ev == TIE_STX){
+		dropStaged(ctx);	/* Groups received outside a frame */
+		if(atomic_load_explicit(&ctx->reload, memory_order_relaxed))	/* New configuration */
+			applyConfiguration(ctx);
+		batchStart(ctx);
+		return;
+	} else if(ev == TIE_ETX){
+		for(struct PubLabel *pl = ctx->staged; pl; pl = pl->nextstaged)
+			publishValue(ctx, pl);
+		dropStaged(ctx);
+		batchPublish(ctx);
+		if(ctx->snap)
+			snapshotFrame(ctx);
+		return;
+	} else if(ev == TIE_EOT){
+		dropStaged(ctx);
+		batchAbort(ctx);
+		return;
+	}
 
-				else if(!strcmp(buffer,"????"))
-					strcpy(cctopic + szcc, "HHPHC");
-					strcpy(cctopic + szcc, "PTEC");
-*/
-				else
-					ccfound = false;
-			}
+	struct PubLabel *pl = findLabel(ctx->pub, grp->label);
+	if(pl)	/* Found in topic to publish */
+		stageGroup(ctx, pl, grp);
+}
 
-			if(!getPayload(fframe, buffer, 0x09, 256))
-				break;	/* File is over */
-			if(!*buffer)	/* Can't load the payload */
-				continue;
-	
-			char *dt = buffer;
-			if(horodate){	/* The date is embedded */
-				dt = buffer + strlen(buffer) + 1;
-
-				if(!getPayload(fframe, dt, 0x09, 256))
-					break;	/* File is over */
-				if(!*dt)	/* Can't load the payload */
-					continue;
-			}
+void *process_standard(void *actx){
+	struct CSection *ctx = actx;	/* Only to avoid zillions of cast */
+	struct TIGroup grp;
+	enum TIEvent ev;
 
-			unsigned int t = atoi(dt);
-			if(!raw)
-				sprintf(dt, "%u", t);
-
-			if(sz){
-				if(debug){
-					if(horodate)
-						printf("*d* [%s] Publishing '%s' : '%s' '%s'\n", ctx->name, topic, buffer, dt);
-					else
-						printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, topic, dt);
-				}
-				papub(topic, strlen(dt), dt, 0);
-				if(horodate){
-					strcat(topic, "/h");
-					papub(topic, strlen(buffer), buffer, 0);
-				}
-			}
+	if(debug)
+		printf("Launching a processing standard for '%s'\n", ctx->name);
 
-#if 0
-			if(round){	/* Round the value for compatibility mode */
-				t -= t%10;
-				sprintf(dt, "%u", t);
-			}
-#endif
-			if(cpfound){
-				if(debug)
-					printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, cptopic, dt);
-				papub(cptopic, strlen(dt), dt, 0);
-			}
-			if(ccfound){
-				if(ptec)
-					strcpy(dt, (t>1) ? "HP..":"HC..");
+	initReader(&ctx->rd, openPort(ctx, false), 0x09);
 
-				if(debug)
-					printf("*d* [%s] Publishing '%s' : '%s'\n", ctx->name, cctopic, dt);
-				papub(cctopic, strlen(dt), dt, 0);
-			}
-		}
-	}
+	while((ev = readEvent(&ctx->rd, &grp)))	/* Reading data */
+		handleStandard(ctx, ev, &grp);
 
-	if(debug){
-		printf("*d*  [%s] Input stream closed : thread is finished.\n", ctx->name);
-	}
-	fclose(fframe);
+	streamClosed(ctx);
 	pthread_exit(0);
 }
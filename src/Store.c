@@ -0,0 +1,397 @@
+/*
+ *	Store.c
+ *		Local time series storage
+ *
+ * Copyright 2015-2024 Laurent Faillie (destroyedlolo)
+ *
+ *	TeleInfod is covered by
+ *	Creative Commons Attribution-NonCommercial 3.0 License
+ *	(http://creativecommons.org/licenses/by-nc/3.0/)
+ *	Consequently, you're free to use if for personal or non-profit usage,
+ *	professional or commercial usage REQUIRES a commercial licence.
+ *
+ *	TeleInfod is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * When Store= is set, every numeric value received is appended to
+ *	<Store>/<segment's start>/<LABEL>
+ * Segments last Store_Segment= seconds ; only the last Store_Keep= ones
+ * are kept. Each column is a memory mapped file : a small header, which
+ * also holds encoder's state (so appending resumes after a restart),
+ * followed by a bit stream :
+ * 	- timestamps are delta-of-delta encoded (1 bit for a regular flow),
+ * 	- so are energy indexes (u64 counters) as they grow steadily,
+ * 	- other values are XORed with the previous one (Gorilla like) as
+ * 	they mostly stay the same or change only few bits.
+ *
+ * Decoding functions are shared with the query tool (TIQuery.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "TeleInfod.h"
+#include "Config.h"
+
+#define COLUMN_MAGIC "TICOL001"
+#define COLUMN_CHUNK (64*1024)	/* Files grow by this size */
+
+	/* **
+	 * Bit stream
+	 * **/
+
+static bool putBits(struct Column *col, uint64_t v, unsigned int nb){
+/* Append the nb lowest bits of v
+ * <- false if the file can't grow
+ */
+	struct ColumnHeader *h = col->hdr;
+	size_t need = sizeof(struct ColumnHeader) + (h->bits + nb + 7) / 8;
+
+	if(need > col->mapped){	/* Grow the file */
+		size_t sz = col->mapped + COLUMN_CHUNK;
+		if(ftruncate(col->fd, sz) == -1)
+			return false;
+		void *m = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, col->fd, 0);
+		if(m == MAP_FAILED)
+			return false;
+		munmap(col->hdr, col->mapped);
+		col->hdr = h = m;
+		col->mapped = sz;
+	}
+
+	unsigned char *data = (unsigned char *)(h + 1);
+	for(unsigned int i = nb; i--; ){
+		uint64_t pos = h->bits++;
+		if(v & ((uint64_t)1 << i))
+			data[pos / 8] |= 0x80 >> (pos % 8);
+		else
+			data[pos / 8] &= ~(0x80 >> (pos % 8));
+	}
+	return true;
+}
+
+static uint64_t getBits(struct ColumnReader *rd, unsigned int nb){
+	uint64_t v = 0;
+
+	while(nb--){
+		uint64_t pos = rd->pos++;
+		v = (v << 1) | ((rd->data[pos / 8] >> (7 - pos % 8)) & 1);
+	}
+	return v;
+}
+
+	/* **
+	 * Codecs
+	 * **/
+
+static bool putDoD(struct Column *col, int64_t dod){
+/* Delta of delta */
+	if(!dod)
+		return putBits(col, 0, 1);
+	else if(dod >= -63 && dod <= 64)
+		return putBits(col, 2, 2) && putBits(col, dod + 63, 7);
+	else if(dod >= -255 && dod <= 256)
+		return putBits(col, 6, 3) && putBits(col, dod + 255, 9);
+	else if(dod >= -2047 && dod <= 2048)
+		return putBits(col, 14, 4) && putBits(col, dod + 2047, 12);
+	return putBits(col, 15, 4) && putBits(col, (uint64_t)dod, 64);
+}
+
+static int64_t getDoD(struct ColumnReader *rd){
+	if(!getBits(rd, 1))
+		return 0;
+	if(!getBits(rd, 1))
+		return (int64_t)getBits(rd, 7) - 63;
+	if(!getBits(rd, 1))
+		return (int64_t)getBits(rd, 9) - 255;
+	if(!getBits(rd, 1))
+		return (int64_t)getBits(rd, 12) - 2047;
+	return (int64_t)getBits(rd, 64);
+}
+
+static bool putXor(struct Column *col, uint64_t v){
+	struct ColumnHeader *h = col->hdr;
+	uint64_t x = v ^ h->lastv;
+
+	if(!x)	/* Same value */
+		return putBits(col, 0, 1);
+
+	unsigned int lz = __builtin_clzll(x), tz = __builtin_ctzll(x);
+	unsigned int leading = h->leading, trailing = h->trailing;	/* h may move while growing */
+
+	if(leading <= 63 && lz >= leading && tz >= trailing)	/* Fits in the previous window */
+		return putBits(col, 2, 2) && putBits(col, x >> trailing, 64 - leading - trailing);
+
+	h->leading = lz;
+	h->trailing = tz;
+	return putBits(col, 3, 2) && putBits(col, lz, 6) && putBits(col, 63 - lz - tz, 6) && putBits(col, x >> tz, 64 - lz - tz);
+}
+
+static uint64_t getXor(struct ColumnReader *rd){
+	if(!getBits(rd, 1))
+		return rd->v;
+
+	if(getBits(rd, 1)){	/* New window */
+		rd->leading = getBits(rd, 6);
+		rd->trailing = 64 - rd->leading - (getBits(rd, 6) + 1);
+	}
+	return rd->v ^ (getBits(rd, 64 - rd->leading - rd->trailing) << rd->trailing);
+}
+
+	/* **
+	 * Writer
+	 * **/
+
+static void pruneSegments(struct CSection *s){
+/* Keep only the last Store_Keep segments */
+	struct dirent **lst;
+	int nb = scandir(s->storedir, &lst, NULL, alphasort);
+
+	if(nb < 0)
+		return;
+
+	for(int i=0; i<nb; i++){
+		char *end;
+		strtoll(lst[i]->d_name, &end, 10);
+		if(*end || !*lst[i]->d_name){	/* Not a segment */
+			free(lst[i]);
+			lst[i] = NULL;
+		}
+	}
+
+	int kept = 0;
+	for(int i=nb; i--; ){	/* alphasort is fine as all names have the same length */
+		if(!lst[i])
+			continue;
+		if(++kept > (int)s->storekeep){
+			char path[strlen(s->storedir) + 2*NAME_MAX + 3];
+			sprintf(path, "%s/%s", s->storedir, lst[i]->d_name);
+
+			DIR *d = opendir(path);
+			if(d){
+				struct dirent *e;
+				while((e = readdir(d)))
+					if(*e->d_name != '.'){
+						char file[sizeof(path)];
+						sprintf(file, "%s/%s/%s", s->storedir, lst[i]->d_name, e->d_name);
+						unlink(file);
+					}
+				closedir(d);
+			}
+			if(!rmdir(path) && debug)
+				printf("*I* [%s] Segment '%s' removed\n", s->name, path);
+		}
+		free(lst[i]);
+	}
+	free(lst);
+}
+
+static void closeColumn(struct Column *col){
+	if(!col->hdr)
+		return;
+
+	size_t used = sizeof(struct ColumnHeader) + (col->hdr->bits + 7) / 8;
+	munmap(col->hdr, col->mapped);
+	if(ftruncate(col->fd, used) == -1)
+		perror("ftruncate()");
+	close(col->fd);
+	col->hdr = NULL;
+}
+
+static bool openColumn(struct CSection *s, struct PubLabel *pl, int64_t seg){
+/* Open (or create) label's column in a segment */
+	struct Column *col = pl->col;
+	char path[strlen(s->storedir) + strlen(pl->name) + 24];
+	struct stat st;
+
+	sprintf(path, "%s/%010lld", s->storedir, (long long)seg);
+	if(!mkdir(path, 0755)){	/* New segment */
+		if(debug)
+			printf("*I* [%s] New segment '%s'\n", s->name, path);
+		if(s->storekeep)
+			pruneSegments(s);
+	} else if(errno != EEXIST){
+		perror(path);
+		return false;
+	}
+
+	sprintf(path, "%s/%010lld/%s", s->storedir, (long long)seg, pl->name);
+	if((col->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1){
+		perror(path);
+		return false;
+	}
+
+	if(fstat(col->fd, &st) == -1 || (st.st_size < (off_t)sizeof(struct ColumnHeader) && ftruncate(col->fd, COLUMN_CHUNK) == -1)){
+		perror(path);
+		close(col->fd);
+		return false;
+	}
+
+	col->mapped = (st.st_size < (off_t)sizeof(struct ColumnHeader)) ? COLUMN_CHUNK : (size_t)st.st_size;
+	void *m = mmap(NULL, col->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, col->fd, 0);
+	if(m == MAP_FAILED){
+		perror(path);
+		close(col->fd);
+		return false;
+	}
+	col->hdr = m;
+	col->seg = seg;
+
+	unsigned char codec = (pl->type == VT_U64) ? CODEC_DOD : CODEC_XOR;
+	if(memcmp(col->hdr->magic, COLUMN_MAGIC, 8) || col->hdr->codec != codec){	/* New column */
+		memset(col->hdr, 0, sizeof(struct ColumnHeader));
+		memcpy(col->hdr->magic, COLUMN_MAGIC, 8);
+		col->hdr->codec = codec;
+		col->hdr->leading = 0xff;	/* No window yet */
+	}
+	return true;
+}
+
+void initStore(struct CSection *s, unsigned int seg, unsigned int keep){
+	s->storeseg = seg;
+	s->storekeep = keep;
+
+	if(mkdir(s->storedir, 0755) == -1 && errno != EEXIST){
+		perror(s->storedir);
+		exit(EXIT_FAILURE);
+	}
+
+	storeColumns(s->pub);
+}
+
+void storeColumns(struct LabelSet *set){
+/* Columns of labels to store */
+	for(unsigned int i=0; i<set->nb; i++)
+		assert( (set->labels[i].col = cfgCalloc(1, sizeof(struct Column))) );
+}
+
+void closeColumns(struct LabelSet *set){
+	for(unsigned int i=0; i<set->nb; i++)
+		if(set->labels[i].col)
+			closeColumn(set->labels[i].col);
+}
+
+void storeValue(struct CSection *s, struct PubLabel *pl){
+/* Append label's decoded value */
+	const struct TIValue *v = &pl->value;
+	struct Column *col = pl->col;
+
+	if(!v->valid || pl->type == VT_STRING || pl->type == VT_DATE)
+		return;
+
+	int64_t t = v->received;
+	int64_t seg = t - t % s->storeseg;
+
+	if(col->hdr && col->seg != seg)	/* Rotation */
+		closeColumn(col);
+	if(!col->hdr && !openColumn(s, pl, seg))
+		return;
+
+	struct ColumnHeader *h = col->hdr;
+	bool ok = true;
+
+	if(!h->count){
+		h->firstt = h->lastt = t;
+		h->firstv = h->lastv = v->num;
+		h->lastdt = h->lastdv = 0;
+	} else {	/* Note : h moves when the file grows */
+		int64_t dt = t - h->lastt;
+		int64_t dv = (int64_t)(v->num - h->lastv);
+		int64_t dod = dv - h->lastdv;
+
+		ok = putDoD(col, dt - h->lastdt);
+		if(ok && col->hdr->codec == CODEC_DOD){
+			ok = putDoD(col, dod);
+			col->hdr->lastdv = dv;
+		} else if(ok)
+			ok = putXor(col, v->num);
+
+		h = col->hdr;
+		h->lastdt = dt;
+		h->lastt = t;
+		h->lastv = v->num;
+	}
+
+	if(!ok){
+		fprintf(stderr, "*E* [%s] Can't store '%s' : %s\n", s->name, pl->name, strerror(errno));
+		closeColumn(col);
+		return;
+	}
+	h->count++;
+}
+
+void closeStore(struct CSection *s){
+	closeColumns(s->pub);
+}
+
+	/* **
+	 * Reader
+	 * **/
+
+bool openColumnReader(struct ColumnReader *rd, const char *path){
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if(fd == -1)
+		return false;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct ColumnHeader)){
+		close(fd);
+		return false;
+	}
+
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED)
+		return false;
+
+	rd->hdr = m;
+	rd->size = st.st_size;
+	if(memcmp(rd->hdr->magic, COLUMN_MAGIC, 8) || sizeof(struct ColumnHeader) + (rd->hdr->bits + 7) / 8 > rd->size){
+		munmap(m, rd->size);
+		return false;
+	}
+
+	rd->data = (const unsigned char *)(rd->hdr + 1);
+	rd->pos = 0;
+	rd->idx = 0;
+	rd->leading = rd->trailing = 0;
+	return true;
+}
+
+bool columnNext(struct ColumnReader *rd, int64_t *t, uint64_t *v){
+/* <- false when all samples have been read */
+	const struct ColumnHeader *h = rd->hdr;
+
+	if(rd->idx >= h->count)
+		return false;
+
+	if(!rd->idx++){
+		rd->t = h->firstt;
+		rd->v = h->firstv;
+		rd->dt = rd->dv = 0;
+	} else {
+		rd->dt += getDoD(rd);
+		rd->t += rd->dt;
+		if(h->codec == CODEC_DOD){
+			rd->dv += getDoD(rd);
+			rd->v += rd->dv;
+		} else
+			rd->v = getXor(rd);
+	}
+
+	*t = rd->t;
+	*v = rd->v;
+	return true;
+}
+
+void closeColumnReader(struct ColumnReader *rd){
+	munmap((void *)rd->hdr, rd->size);
+}
@@ -21,213 +21,381 @@
 #include <assert.h>
 #include <ctype.h>
 #include <signal.h>
+#include <stdatomic.h>
+#ifdef SMALL_FOOTPRINT
+#	include <malloc.h>
+#endif
 
 #ifdef USE_MOSQUITTO
 #	include <mosquitto.h>
 #elif defined(USE_PAHO)
 #	include <MQTTClient.h>
+#elif defined(USE_PAHO_ASYNC)
+#	include <MQTTAsync.h>
+#	include <semaphore.h>
 #endif
 
 #include "Version.h"
 #include "Config.h"
 #include "TeleInfod.h"
 
-unsigned int debug = 0;
 static const char *Broker_Host;
 #ifdef USE_MOSQUITTO
 static int Broker_Port;
 #endif
+static unsigned int Broker_QoS;
+static unsigned int Broker_Version;	/* MQTT protocol : 3 (3.1.1) or 5 */
+static unsigned int Broker_Aliases;
+#ifdef USE_PAHO_ASYNC
+static unsigned int Broker_Inflight;
+#endif
+static size_t Queue_Size;
+static size_t Spool_Size;
+static unsigned int Replay_Rate;
+static unsigned int Workers;
+static unsigned int Store_Segment;
+static unsigned int Store_Keep;
+static const char *Metrics;
+#ifdef LATENCY_STATS
+static const char *Latency_Topic;
+static unsigned int Latency_Interval;
+#endif
 static struct CSection *sections;
+struct BrokerStats brokerstats;
 
 #ifdef USE_MOSQUITTO
 static struct mosquitto *mosq;
 #elif defined(USE_PAHO)
 MQTTClient client;
+#elif defined(USE_PAHO_ASYNC)
+static MQTTAsync client;
 #else
 #	error "No MQTT library defined"
 #endif
 
 	/* **
-	 * Helpers
+	 * General directives are read in "parsed" : they are applied at
+	 * startup and, while reloading, only compared with running ones
+	 * (threads are using them).
 	 * **/
-char *removeLF(char *s){
-	size_t l=strlen(s);
-	if(l && s[--l] == '\n')
-		s[l] = 0;
-	return s;
-}
-
-char *striKWcmp( char *s, const char *kw ){
-/* compares string s against kw
- * Returns :
- * 	- remaining string if the keyword matches
- * 	- NULL if the keyword is not found
- */
-	size_t klen = strlen(kw);
-	if( strncasecmp(s,kw,klen) )
-		return NULL;
-	else
-		return s+klen;
-}
-
+static struct Globals {
+	const char *host;
+#ifdef USE_MOSQUITTO
+	int port;
+#endif
+	unsigned int qos;
+	unsigned int version;
+	unsigned int aliases;
+#ifdef USE_PAHO_ASYNC
+	unsigned int inflight;
+#endif
+	size_t queue;
+	size_t spool;
+	unsigned int replay;
+	unsigned int workers;
+	unsigned int segment;
+	unsigned int keep;
+	const char *metrics;
+	size_t stack;
+#ifdef LATENCY_STATS
+	const char *latencytopic;
+	unsigned int latencyinterval;
+#endif
+} parsed;
+static FILE *conffile;	/* being read */
 
-	/* **
-	 * Frame's handling
-	 * **/
-void debugchar(const char x){
-	if(debug>1){
-		if(isprint(x))
-			putchar(x);
-		else
-			printf("<%02x>", x);
-	}
+static void freeGlobals(void){
+	cfgFree((void *)parsed.host);
+	cfgFree((void *)parsed.metrics);
+	parsed.host = parsed.metrics = NULL;
+#ifdef LATENCY_STATS
+	cfgFree((void *)parsed.latencytopic);
+	parsed.latencytopic = NULL;
+#endif
 }
 
-const char *getLabel(FILE *f, char *buffer, char sep){
-/* Wait for the next label and store it in the buffer
- * -> buffer : char [9]
- * <- the buffer filled with the label
- *	NULL if the file is over
- */
- 	int c;
-	while(1){
-		if(debug)
-			puts("*d* waiting for the beginning");
-
-		do {
-			c=fgetc(f);
-
-			if(c == EOF)
-				return NULL;
-			debugchar(c);
-		} while(c != 0x0a);
-
-		if(debug)
-			puts("\n*d* Reading the label");
-		int i;
-		for(i=0; i<9; i++){
-			c=fgetc(f);
-			if(c == EOF)
-				return NULL;
-			else if(c == sep)
-				break;
-
-			buffer[i]= (char)c;
-			debugchar(c);
-		}
-
-		if(i<9){	/* A label is found */
-			buffer[i]=0;
-			if(debug)
-				printf("\n*d* Found '%s'\n", buffer);
-			return buffer;
-		}
-
-		/* Ignoring ... restart from the beginning */
-		if(debug)
-			puts("\n*d* Too long ... restarting");
-	}
+static void applyGlobals(void){
+/* At startup */
+	Broker_Host = parsed.host;
+#ifdef USE_MOSQUITTO
+	Broker_Port = parsed.port;
+#endif
+	Broker_QoS = parsed.qos;
+	Broker_Version = parsed.version;
+	Broker_Aliases = parsed.aliases;
+#ifdef USE_PAHO_ASYNC
+	Broker_Inflight = parsed.inflight;
+#endif
+	Queue_Size = parsed.queue;
+	Spool_Size = parsed.spool;
+	Replay_Rate = parsed.replay;
+	Workers = parsed.workers;
+	Store_Segment = parsed.segment;
+	Store_Keep = parsed.keep;
+	Metrics = parsed.metrics;
+	threadstack = parsed.stack;
+#ifdef LATENCY_STATS
+	Latency_Topic = parsed.latencytopic;
+	Latency_Interval = parsed.latencyinterval;
+#endif
 }
 
-const char *getPayload(FILE *f, char *buffer, char sep, size_t size){
-/* Read the payload.
- * File needs to be positionned at its beginning.
- * -> size : size of the buffer
- * <- the buffer filled with the payload
- * (can be empty if the payload exceeds buffer's size)
- * NULL if the file is over
- */
-	int c;
-	if(debug)
-		puts("\n*d* Reading the payload");
-
-	int i;
-	for(i=0; i<size; i++){
-		c=fgetc(f);
-		if(c == EOF)
-			return NULL;
-		else if(c == sep)
-			break;
-	
-		buffer[i]= (char)c;
-		debugchar(c);
-	}
+static bool sameString(const char *a, const char *b){
+	return a == b || (a && b && !strcmp(a, b));
+}
 
-	if(i<size){
-		buffer[i]=0;
-		if(debug)
-			printf("\n*d* Read '%s'\n", buffer);
-		return buffer;
-	}
+#define CHECK(changed, directive) \
+	if(changed) fputs("*W* " directive " change needs a restart\n", stderr)
 
-	if(debug)
-		puts("\n*d* Too long ...");
+static void checkGlobals(void){
+/* While reloading : running values are kept */
+	CHECK(!sameString(Broker_Host, parsed.host), "Broker_Host");
+#ifdef USE_MOSQUITTO
+	CHECK(Broker_Port != parsed.port, "Broker_Port");
+#endif
+	CHECK(Broker_QoS != parsed.qos, "Broker_QoS");
+	CHECK(Broker_Version != parsed.version, "Broker_Version");
+	CHECK(Broker_Aliases != parsed.aliases, "Broker_Aliases");
+#ifdef USE_PAHO_ASYNC
+	CHECK(Broker_Inflight != parsed.inflight, "Broker_Inflight");
+#endif
+	CHECK(Queue_Size != parsed.queue, "Queue_Size");
+	CHECK(Spool_Size != parsed.spool, "Spool_Size");
+	CHECK(Replay_Rate != parsed.replay, "Replay_Rate");
+	CHECK(Workers != parsed.workers, "Workers");
+	CHECK(Store_Segment != parsed.segment, "Store_Segment");
+	CHECK(Store_Keep != parsed.keep, "Store_Keep");
+	CHECK(!sameString(Metrics, parsed.metrics), "Metrics");
+	CHECK(threadstack != parsed.stack, "Thread_Stack");
+#ifdef LATENCY_STATS
+	CHECK(!sameString(Latency_Topic, parsed.latencytopic), "Latency_Topic");
+	CHECK(Latency_Interval != parsed.latencyinterval, "Latency_Interval");
+#endif
 
-	*buffer = 0;
-	return buffer;
+	freeGlobals();
 }
 
 	/* **
 	 * Fill configuration from given configuration file
 	 * -> fch : configuration file to read
+	 * -> reload : the daemon is already running, global settings are
+	 *	only checked (they are used at startup)
+	 * <- sections found (the last one first)
 	 * **/
-static void read_configuration(const char *fch){
-	FILE *f;
+static struct CSection *read_configuration(const char *fch, bool reload){
 	char l[MAXLINE];
 	char *arg;
 	unsigned int ln = 0;
+	struct CSection *sections = NULL;
+
+	if(!reload){
+#if defined(USE_PAHO) || defined(USE_PAHO_ASYNC)
+		client = NULL;
+#else
+		mosq = NULL;
+#endif
+	}
 
 		/* default configuration */
-#ifdef USE_PAHO
-	Broker_Host = "tcp://localhost:1883";
-	client = NULL;
+#if defined(USE_PAHO) || defined(USE_PAHO_ASYNC)
+	assert( (parsed.host = cfgStrdup("tcp://localhost:1883")) );
 #else
-	Broker_Host = "localhost";
-	Broker_Port = 1883;
-	mosq = NULL;
+	assert( (parsed.host = cfgStrdup("localhost")) );
+	parsed.port = 1883;
+#endif
+	parsed.qos = 0;
+	parsed.version = 3;
+	parsed.aliases = DEFAULT_ALIASES;
+#ifdef USE_PAHO_ASYNC
+	parsed.inflight = DEFAULT_INFLIGHT;
+#endif
+	parsed.queue = DEFAULT_QUEUE_SIZE;
+	parsed.spool = DEFAULT_SPOOL_SIZE;
+	parsed.replay = DEFAULT_REPLAY_RATE;
+	parsed.workers = 0;	/* A thread per section */
+	parsed.segment = DEFAULT_STORE_SEGMENT;
+	parsed.keep = 0;	/* Keep everything */
+	parsed.metrics = NULL;	/* No scrape endpoint */
+	parsed.stack = DEFAULT_THREAD_STACK * 1024;
+#ifdef LATENCY_STATS
+	parsed.latencytopic = NULL;	/* Not published */
+	parsed.latencyinterval = DEFAULT_LATENCY_INTERVAL;
 #endif
 
 	if(debug)
 		printf("Reading configuration file '%s'\n", fch);
 
 		/* Reading the configuration file */
-	if(!(f=fopen(fch, "r"))){
+	if(!(conffile=fopen(fch, "r"))){
 		perror(fch);
-		exit(EXIT_FAILURE);
+		configError();
 	}
 
-	while(fgets(l, MAXLINE, f)){
+	while(fgets(l, MAXLINE, conffile)){
 		ln++;
 
 		if(*l == '#' || *l == '\n')	/* Ignore comments */
 			continue;
 
 		if((arg = striKWcmp(l,"Broker_Host="))){
-			assert( (Broker_Host = strdup(removeLF(arg))) );
+			cfgFree((void *)parsed.host);
+			assert( (parsed.host = cfgStrdup(removeLF(arg))) );
 			if(debug)
-				printf("\tBroker host : '%s'\n", Broker_Host);
+				printf("\tBroker host : '%s'\n", parsed.host);
 		} else if((arg = striKWcmp(l,"Broker_Port="))){
-#if defined(USE_PAHO)
+#if defined(USE_PAHO) || defined(USE_PAHO_ASYNC)
 			fprintf(stderr, "\nERROR line %u : When using Paho library, Broker_Port directive is not used.\n"
 				"Instead, use\n"
 				"\tBroker_Host=protocol://host:port\n", ln);
-			exit(EXIT_FAILURE);
+			configError();
+#else
+			parsed.port = atoi( arg );
+			if(debug)
+				printf("Broker port : %d\n", parsed.port);
+#endif
+		} else if((arg = striKWcmp(l,"Broker_QoS="))){
+			parsed.qos = atoi(arg);
+			if(parsed.qos > 2){
+				fprintf(stderr, "\nERROR line %u : Broker_QoS has to be 0, 1 or 2\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("Publishing QoS : %u\n", parsed.qos);
+		} else if((arg = striKWcmp(l,"Broker_Version="))){
+			parsed.version = atoi(arg);
+			if(parsed.version != 3 && parsed.version != 5){
+				fprintf(stderr, "\nERROR line %u : Broker_Version has to be 3 (3.1.1) or 5\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("MQTT version : %s\n", parsed.version == 5 ? "5" : "3.1.1");
+		} else if((arg = striKWcmp(l,"Broker_Aliases="))){
+			parsed.aliases = atoi(arg);
+			if(parsed.aliases > 65535){
+				fprintf(stderr, "\nERROR line %u : Broker_Aliases can't exceed 65535\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("Topic aliases : %u at most\n", parsed.aliases);
+		} else if((arg = striKWcmp(l,"Broker_Inflight="))){
+#ifdef USE_PAHO_ASYNC
+			if(!(parsed.inflight = atoi(arg))){
+				fprintf(stderr, "\nERROR line %u : Broker_Inflight can't be null\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("In-flight window : %u messages\n", parsed.inflight);
+#else
+			fprintf(stderr, "\nERROR line %u : Broker_Inflight is only used by Paho asynchronous library\n", ln);
+			configError();
+#endif
+		} else if((arg = striKWcmp(l,"Queue_Size="))){
+			parsed.queue = strtoul(arg, NULL, 10);
+			if(debug)
+				printf("Publishing queues size : %lu\n", (unsigned long)parsed.queue);
+		} else if((arg = striKWcmp(l,"Spool_Size="))){
+			parsed.spool = strtoul(arg, NULL, 10);
+			if(debug)
+				printf("Spools size : %lu\n", (unsigned long)parsed.spool);
+		} else if((arg = striKWcmp(l,"Replay_Rate="))){
+			if(!(parsed.replay = atoi(arg))){
+				fprintf(stderr, "\nERROR line %u : Replay_Rate can't be null\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("Replay rate : %u messages per second\n", parsed.replay);
+		} else if((arg = striKWcmp(l,"Store_Segment="))){
+			if(!(parsed.segment = atoi(arg))){
+				fprintf(stderr, "\nERROR line %u : Store_Segment can't be null\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("Local storage segments : %u seconds\n", parsed.segment);
+		} else if((arg = striKWcmp(l,"Store_Keep="))){
+			parsed.keep = atoi(arg);
+			if(debug)
+				printf("Local storage segments kept : %u\n", parsed.keep);
+		} else if((arg = striKWcmp(l,"Metrics="))){
+			cfgFree((void *)parsed.metrics);
+			assert( (parsed.metrics = cfgStrdup(removeLF(arg))) );
+			if(debug)
+				printf("Metrics endpoint : '%s'\n", parsed.metrics);
+		} else if((arg = striKWcmp(l,"Latency_Topic="))){
+#ifdef LATENCY_STATS
+			cfgFree((void *)parsed.latencytopic);
+			assert( (parsed.latencytopic = cfgStrdup(removeLF(arg))) );
+			if(debug)
+				printf("Latencies published on '%s'\n", parsed.latencytopic);
 #else
-			Broker_Port = atoi( arg );
+			fprintf(stderr, "\nERROR line %u : Latency_Topic needs TeleInfod to be compiled with LATENCY_STATS\n", ln);
+			configError();
+#endif
+		} else if((arg = striKWcmp(l,"Latency_Interval="))){
+#ifdef LATENCY_STATS
+			if(!(parsed.latencyinterval = atoi(arg))){
+				fprintf(stderr, "\nERROR line %u : Latency_Interval can't be null\n", ln);
+				configError();
+			}
 			if(debug)
-				printf("Broker port : %d\n", Broker_Port);
+				printf("Latencies published every %u seconds\n", parsed.latencyinterval);
+#else
+			fprintf(stderr, "\nERROR line %u : Latency_Interval needs TeleInfod to be compiled with LATENCY_STATS\n", ln);
+			configError();
 #endif
+		} else if((arg = striKWcmp(l,"Thread_Stack="))){
+			unsigned int kb = atoi(arg);
+			if(kb && kb < 16){	/* PTHREAD_STACK_MIN */
+				fprintf(stderr, "\nERROR line %u : Thread_Stack can't be less than 16 KB\n", ln);
+				configError();
+			}
+			parsed.stack = (size_t)kb * 1024;
+			if(debug){
+				if(kb)
+					printf("Threads' stack : %u KB\n", kb);
+				else
+					puts("Threads' stack : system's default");
+			}
+		} else if((arg = striKWcmp(l,"Workers="))){
+			parsed.workers = atoi(arg);
+			if(debug){
+				if(parsed.workers)
+					printf("Sections multiplexed on %u worker(s)\n", parsed.workers);
+				else
+					puts("A thread per section");
+			}
 		} else if(*l == '*'){	/* New section */
-			struct CSection *n = malloc( sizeof(struct CSection) );
+			struct CSection *n = cfgAlloc( sizeof(struct CSection) );
 			assert(n);
 
-			assert( (n->name = strdup( removeLF(l+1) )) );	/* Name */
+			assert( (n->name = cfgStrdup( removeLF(l+1) )) );	/* Name */
 
 				/* Default value */
 			n->port = NULL;
+			n->baud = 0;	/* depends on frames' kind */
+			n->databits = 7;
+			n->parity = 'E';
+			n->stopbits = 1;
+			n->lowlatency = false;
+			n->vmin = 1;
+			n->vtime = 0;
 			n->labels = NULL;
 			n->standard = true;
 			n->topic = n->cctopic = n->cptopic = NULL;
+			n->refresh = 0;
+			n->deadbands = NULL;
+			n->frametopic = NULL;
+			n->encoding = ENC_TEXT;
+			n->keyframes = 0;
+			n->spoolfile = NULL;
+			n->storedir = NULL;
+			n->snapshot = NULL;
+			n->snap = NULL;
+			n->sinks = NULL;
+			n->pub = NULL;
+			n->batch = NULL;
+			n->staged = n->stagedlast = NULL;
+			atomic_init(&n->reload, NULL);
+			atomic_init(&n->retired, NULL);
 
 				/* Sections management */
 			n->next = sections;
@@ -238,13 +406,13 @@ static void read_configuration(const char *fch){
 		} else if((arg = striKWcmp(l,"Port="))){	/* It's an historic section */
 			if(!sections){
 				fputs("*F* Configuration issue : Port directive outside a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
 			if(sections->port){
 				fputs("*F* Configuration issue : Port directive used more than once in a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
-			assert( (sections->port = strdup( removeLF(arg) )) );
+			assert( (sections->port = cfgStrdup( removeLF(arg) )) );
 			sections->standard = false;
 
 			if(debug)
@@ -252,83 +420,516 @@ static void read_configuration(const char *fch){
 		} else if((arg = striKWcmp(l,"SPort="))){	/* It's a standard section */
 			if(!sections){
 				fputs("*F* Configuration issue : SPort directive outside a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
 			if(sections->port){
 				fputs("*F* Configuration issue : SPort directive used more than once in a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
-			assert( (sections->port = strdup( removeLF(arg) )) );
+			assert( (sections->port = cfgStrdup( removeLF(arg) )) );
 			sections->standard = true;
 
 			if(debug)
 				printf("\tStandard frame\n\tSerial port : '%s'\n", sections->port);
+		} else if((arg = striKWcmp(l,"Baud="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Baud directive outside a section\n", stderr);
+				configError();
+			}
+			sections->baud = atoi(arg);
+			if(!checkBaud(sections->baud)){
+				fprintf(stderr, "\nERROR line %u : unsupported baud rate\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("\tBaud rate : %u\n", sections->baud);
+		} else if((arg = striKWcmp(l,"Mode="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Mode directive outside a section\n", stderr);
+				configError();
+			}
+			if(!parseMode(sections, removeLF(arg))){
+				fprintf(stderr, "\nERROR line %u : Mode expected as <data bits><N|E|O><stop bits> (like 7E1)\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("\tMode : %s\n", arg);
+		} else if((arg = striKWcmp(l,"ReadPolicy="))){
+			if(!sections){
+				fputs("*F* Configuration issue : ReadPolicy directive outside a section\n", stderr);
+				configError();
+			}
+			if(!parseReadPolicy(sections, removeLF(arg))){
+				fprintf(stderr, "\nERROR line %u : ReadPolicy expected as lowlatency or batch[:vmin[:vtime]]\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("\tRead policy : %s\n", arg);
 		} else if((arg = striKWcmp(l,"Topic="))){
 			if(!sections){
 				fputs("*F* Configuration issue : Topic directive outside a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
 			if(sections->topic){
 				fputs("*F* Configuration issue : Topic directive used more than once in a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
-			assert( (sections->topic = strdup( removeLF(arg) )) );
+			assert( (sections->topic = cfgStrdup( removeLF(arg) )) );
 			if(debug)
 				printf("\tTopic : '%s'\n", sections->topic);
+		} else if((arg = striKWcmp(l,"FrameTopic="))){
+			if(!sections){
+				fputs("*F* Configuration issue : FrameTopic directive outside a section\n", stderr);
+				configError();
+			}
+			if(sections->frametopic){
+				fputs("*F* Configuration issue : FrameTopic directive used more than once in a section\n", stderr);
+				configError();
+			}
+			assert( (sections->frametopic = cfgStrdup( removeLF(arg) )) );
+			if(debug)
+				printf("\tFrame topic : '%s'\n", sections->frametopic);
+		} else if((arg = striKWcmp(l,"Encoding="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Encoding directive outside a section\n", stderr);
+				configError();
+			}
+			if(!parseEncoding(sections, removeLF(arg))){
+				fprintf(stderr, "\nERROR line %u : Encoding expected as text, cbor or msgpack\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("\tEncoding : %s\n", arg);
+		} else if((arg = striKWcmp(l,"KeyFrame="))){
+			if(!sections){
+				fputs("*F* Configuration issue : KeyFrame directive outside a section\n", stderr);
+				configError();
+			}
+			sections->keyframes = atoi(arg);
+			if(debug)
+				printf("\tDelta frames, full one every %u\n", sections->keyframes);
 		} else if((arg = striKWcmp(l,"ConvCons="))){
 			if(!sections){
 				fputs("*F* Configuration issue : ConvCons directive outside a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
-			assert( (sections->cctopic = strdup( removeLF(arg) )) );
+			assert( (sections->cctopic = cfgStrdup( removeLF(arg) )) );
 			if(debug)
 				printf("\tConverted customer topic : '%s'\n", sections->cctopic);
 
 		} else if((arg = striKWcmp(l,"ConvProd="))){
 			if(!sections){
 				fputs("*F* Configuration issue : ConvProd directive outside a section\n", stderr);
-				exit(EXIT_FAILURE);
+				configError();
 			}
-			assert( (sections->cptopic = strdup( removeLF(arg) )) );
+			assert( (sections->cptopic = cfgStrdup( removeLF(arg) )) );
 			if(debug)
 				printf("\tConverted producer topic : '%s'\n", sections->cptopic);
+		} else if((arg = striKWcmp(l,"Spool="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Spool directive outside a section\n", stderr);
+				configError();
+			}
+			if(sections->spoolfile){
+				fputs("*F* Configuration issue : Spool directive used more than once in a section\n", stderr);
+				configError();
+			}
+			assert( (sections->spoolfile = cfgStrdup( removeLF(arg) )) );
+			if(debug)
+				printf("\tSpool : '%s'\n", sections->spoolfile);
+		} else if((arg = striKWcmp(l,"Store="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Store directive outside a section\n", stderr);
+				configError();
+			}
+			if(sections->storedir){
+				fputs("*F* Configuration issue : Store directive used more than once in a section\n", stderr);
+				configError();
+			}
+			assert( (sections->storedir = cfgStrdup( removeLF(arg) )) );
+			if(debug)
+				printf("\tLocal storage : '%s'\n", sections->storedir);
+		} else if((arg = striKWcmp(l,"Snapshot="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Snapshot directive outside a section\n", stderr);
+				configError();
+			}
+			if(sections->snapshot){
+				fputs("*F* Configuration issue : Snapshot directive used more than once in a section\n", stderr);
+				configError();
+			}
+			assert( (sections->snapshot = cfgStrdup( removeLF(arg) )) );
+			if(debug)
+				printf("\tShared snapshot : '%s'\n", sections->snapshot);
+		} else if((arg = striKWcmp(l,"Sink="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Sink directive outside a section\n", stderr);
+				configError();
+			}
+			if(!parseSink(sections, removeLF(arg))){
+				fprintf(stderr, "\nERROR line %u : Sink expected as udp:<host>:<port>, unix:<path> or mqtt:<topic>, followed by measurement=, batch=, linger= or queue=\n", ln);
+				configError();
+			}
+			if(debug)
+				printf("\tSink : '%s'\n", arg);
+		} else if((arg = striKWcmp(l,"Refresh="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Refresh directive outside a section\n", stderr);
+				configError();
+			}
+			sections->refresh = atoi(arg);
+			if(debug)
+				printf("\tPublish on change, refreshed every %u seconds\n", sections->refresh);
+		} else if((arg = striKWcmp(l,"Deadband="))){
+			if(!sections){
+				fputs("*F* Configuration issue : Deadband directive outside a section\n", stderr);
+				configError();
+			}
+			assert( (sections->deadbands = cfgStrdup( removeLF(arg) )) );
+			if(debug)
+				printf("\tDeadbands : '%s'\n", sections->deadbands);
 		} else if((arg = striKWcmp(l,"Publish="))){
-			assert( (sections->labels = strdup( removeLF(arg) )) );
+			assert( (sections->labels = cfgStrdup( removeLF(arg) )) );
 			if(debug)
 				printf("\tLabels : '%s'\n", sections->labels);
 		} else {
 			fprintf(stderr, "\nERROR line %u : \"%s\" is not a known configuration directive\n", ln, removeLF(l));
-			exit(EXIT_FAILURE);
+			configError();
 		}
 	}
 
 	if(debug)
 		puts("");
 
-	fclose(f);
+	fclose(conffile);
+	conffile = NULL;
+
+	if(reload)
+		checkGlobals();
+	else
+		applyGlobals();
+	return sections;
+}
+
+static void checkSection(struct CSection *s){
+/* Sanity checks and compilation of a section's publishing settings */
+	if(!s->port){
+		fprintf( stderr, "*F* No port defined for section '%s'\n", s->name );
+		configError();
+	}
+
+	if(!s->labels){
+		fprintf( stderr, "*F* Publishing missing for section '%s'\n", s->name );
+		configError();
+	}
+	if(!s->baud)
+		s->baud = s->standard ? 9600 : 1200;
+	compileLabels(s);
+
+	if(s->standard){	/* check specifics for standard frames */
+		if(!s->topic && !s->cctopic && !s->cptopic && !s->frametopic && !s->sinks){
+			fprintf( stderr, "*F* at least Topic, FrameTopic, ConvCons, ConvProd or Sink has to be provided for standard section '%s'\n", s->name );
+			configError();
+		}
+	} else {	/* check specifics for historic frames */
+		if(!s->topic && !s->frametopic && !s->sinks){
+			fprintf( stderr, "*F* Topic, FrameTopic or Sink is mandatory for historic section '%s'\n", s->name );
+			configError();
+		}
+	}
+	if(s->standard)
+		initStandard(s);
+	else
+		initHistoric(s);
+	initBatch(s);
+}
+
+static void freeRetired(struct CSection *ctx){
+/* Reloading side : free settings replaced so far */
+	struct CSection *n = atomic_exchange_explicit(&ctx->retired, NULL, memory_order_acquire);
+	if(!n)
+		return;
+
+	metricsQuiesce();
+	while(n){
+		struct CSection *next = n->next;
+		freeConfiguration(n);
+		n = next;
+	}
 }
 
+static void reload_configuration(const char *fch){
+/* Hand a new configuration to running sections (see Reload.c) */
+	jmp_buf env;
+	struct CSection *lst, *n, *s;
+
+#ifdef SMALL_FOOTPRINT	/* The arena is sealed */
+	fprintf(stderr, "*W* '%s' can't be reloaded in small footprint mode : restart TeleInfod\n", fch);
+	return;
+#endif
+
+	if(setjmp(env)){	/* Configuration error */
+		configjmp = NULL;
+		if(conffile){	/* while reading it */
+			fclose(conffile);
+			conffile = NULL;
+			freeGlobals();
+		}
+		fputs("*E* Invalid configuration : not reloaded\n", stderr);
+		return;
+	}
+	configjmp = &env;
+
+	if(debug)
+		printf("*I* Reloading '%s'\n", fch);
+
+	lst = read_configuration(fch, true);
+	for(n = lst; n; n = n->next)
+		checkSection(n);
+
+	configjmp = NULL;
+
+	for(s = sections; s; s = s->next){
+		struct CSection **prev;
+
+		for(prev = &lst; *prev; prev = &(*prev)->next)
+			if(!strcmp((*prev)->name, s->name))
+				break;
+
+		if(!(n = *prev)){
+			fprintf(stderr, "*W* [%s] Removed from the configuration : a restart is needed\n", s->name);
+			continue;
+		}
+		*prev = n->next;	/* Not in the list anymore */
+
+		if(strcmp(n->port, s->port) || n->standard != s->standard)
+			fprintf(stderr, "*W* [%s] Port changes need a restart\n", s->name);
+		if(s->storedir)
+			storeColumns(n->pub);
+
+		freeRetired(s);
+		struct CSection *old;
+		if((old = atomic_exchange(&s->reload, n)))	/* Not applied yet, never walked */
+			freeConfiguration(old);
+	}
+
+	while((n = lst)){	/* Unknown sections */
+		fprintf(stderr, "*W* [%s] New section : a restart is needed\n", n->name);
+		lst = n->next;
+		freeConfiguration(n);
+	}
+}
+
+static bool replayStamp(int64_t received, char *buf){
+/* Reception time of a message replayed from a spool (see Spool.c) as
+ * epoch seconds, published as a "ts" MQTT 5 user property
+ * <- false for a live message
+ */
+	if(!received)
+		return false;
+	sprintf(buf, "%lld", (long long)(received / 1000000));
+	return true;
+}
+
+#if defined(LATENCY_STATS) && !defined(USE_PAHO_ASYNC)
+	/*
+	 * With QoS 1 and 2, a message's latency ends when the broker
+	 * acknowledges it, but libmosquitto and synchronous Paho only give
+	 * back its id. Pending messages are kept in a table indexed by this
+	 * id, without any lock : the publisher fills a free slot then marks
+	 * it as sent (release), the library's thread takes it back when the
+	 * acknowledgement comes. If the acknowledgement comes first (before
+	 * papub() returns), it only marks the slot and the publisher records
+	 * the delivery itself. A message whose slot is still used by an older
+	 * one isn't measured, but counted (see Latency.c).
+	 */
+#define TRACKED_SZ	512		/* power of 2 */
+
+enum { TR_FREE = 0, TR_SENT, TR_ACKED };
+#define TRTAG(mid, st)	(((uint32_t)(mid) << 2) | (st))
+
+static struct {
+	atomic_uint tag;		/* TRTAG(mid, state) */
+	struct PubTrack track;	/* only written while not TR_SENT */
+} tracked[TRACKED_SZ];
+
+static bool trackable(const struct PubTrack *t){
+/* <- true if the delivery will be acknowledged */
+	return t && t->section && Broker_QoS;
+}
+
+static void trackSent(const struct PubTrack *t, bool acked, int mid){
+/* Publisher side, once the message is handed to the library */
+	if(!acked){
+		if(t && t->section)	/* QoS 0 : delivered once handed to the library */
+			latencyDelivered(t);
+		return;
+	}
+
+	unsigned int i = mid & (TRACKED_SZ - 1);
+	unsigned int old = atomic_load_explicit(&tracked[i].tag, memory_order_acquire);
+
+	for(;;){
+		if(old == TRTAG(mid, TR_ACKED)){	/* Already acknowledged */
+			atomic_store_explicit(&tracked[i].tag, TRTAG(mid, TR_FREE), memory_order_relaxed);
+			latencyDelivered(t);
+			return;
+		}
+		if((old & 3) == TR_SENT){	/* An older message is still pending */
+			atomic_fetch_add_explicit(&t->section->untracked, 1, memory_order_relaxed);
+			return;
+		}
+
+		tracked[i].track = *t;	/* Free, or a stale acknowledgement */
+		if(atomic_compare_exchange_weak_explicit(&tracked[i].tag, &old, TRTAG(mid, TR_SENT), memory_order_release, memory_order_acquire))
+			return;
+	}
+}
+
+static void trackAcked(int mid){
+/* Library side : PUBACK or PUBCOMP received */
+	unsigned int i = mid & (TRACKED_SZ - 1);
+	unsigned int old = atomic_load_explicit(&tracked[i].tag, memory_order_acquire);
+
+	for(;;){
+		if(old == TRTAG(mid, TR_SENT)){
+			struct PubTrack t = tracked[i].track;
+			atomic_store_explicit(&tracked[i].tag, TRTAG(mid, TR_FREE), memory_order_release);
+			latencyDelivered(&t);
+			return;
+		}
+		if((old & 3) == TR_SENT)	/* Not tracked (slot used by another one) */
+			return;
+
+		if(atomic_compare_exchange_weak_explicit(&tracked[i].tag, &old, TRTAG(mid, TR_ACKED), memory_order_release, memory_order_acquire))
+			return;
+	}
+}
+#endif
+
 #ifdef USE_MOSQUITTO
-int papub( const char *topic, int length, void *payload, int retained ){	/* Custom wrapper to publish */
-	switch(mosquitto_publish(mosq, NULL, topic, length, payload, 0, retained ? true : false)){
-	case MOSQ_ERR_INVAL:
-		fputs("The input parameters were invalid",stderr);
-		break;
-	case MOSQ_ERR_NOMEM:
-		fputs("An out of memory condition occurred",stderr);
-		break;
-	case MOSQ_ERR_NO_CONN:
-		fputs("The client isn’t connected to a broker",stderr);
-		break;
-	case MOSQ_ERR_PROTOCOL:
-		fputs("There is a protocol error communicating with the broker",stderr);
-		break;
-	case MOSQ_ERR_PAYLOAD_SIZE:
-		fputs("Payloadlen is too large",stderr);
-		break;
+	/*
+	 * Mosquitto's specific functions
+	 *
+	 * Network I/O are handled by libmosquitto's own thread (started by
+	 * mosquitto_loop_start()) : it flushes queued messages, handles
+	 * keep alive and reconnects automatically.
+	 *
+	 * That thread calls on_disconnect() before reconnecting. aliaslock
+	 * is held from topicAlias() until the message is queued, so a message
+	 * using an alias of the lost connection is queued before aliases are
+	 * forgotten, never on the new connection.
+	 */
+static atomic_bool mosq_connected;
+static pthread_mutex_t aliaslock = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_connect(struct mosquitto *m, void *ctx, int rc){
+	if(rc)
+		fprintf(stderr, "*E* Connection refused : %s\n", mosquitto_connack_string(rc));
+	else {
+		atomic_store(&mosq_connected, true);
+		if(debug)
+			puts("*I* Connected to the broker");
 	}
+}
 
-	return 1;
+static void on_connect_v5(struct mosquitto *m, void *ctx, int rc, int flags, const mosquitto_property *props){
+	uint16_t max = 0;	/* No alias if the broker doesn't tell */
+
+	if(!rc){
+		mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &max, false);
+		aliasesConnected(max);	/* before anything is published */
+	}
+	on_connect(m, ctx, rc);
+}
+
+static void inflightDone(void){
+/* A message left libmosquitto's queue
+ * Never below 0 : the counter may have been reset meanwhile
+ */
+	unsigned int n = atomic_load(&brokerstats.inflight);
+	while(n && !atomic_compare_exchange_weak(&brokerstats.inflight, &n, n - 1));
+}
+
+static void on_disconnect(struct mosquitto *m, void *ctx, int rc){
+	pthread_mutex_lock(&aliaslock);
+	atomic_store(&mosq_connected, false);
+	if(Broker_Version == 5)
+		aliasesDisconnected();
+	pthread_mutex_unlock(&aliaslock);
+	if(!Broker_QoS)	/* QoS 0 messages not sent yet are dropped : on_publish() won't be called for them */
+		atomic_store(&brokerstats.inflight, 0);
+	if(rc)	/* Unexpected : libmosquitto will reconnect */
+		printf("*W* Broker connection lost due to %s\n", mosquitto_strerror(rc));
+}
+
+bool brokerConnected(void){
+	return atomic_load(&mosq_connected);
+}
+
+void brokerReconnect(void){
+	/* Done by libmosquitto's loop */
+}
+
+static void on_publish(struct mosquitto *m, void *ctx, int mid){
+	inflightDone();
+	atomic_fetch_add(&brokerstats.delivered, 1);
+#ifdef LATENCY_STATS
+	if(Broker_QoS)	/* PUBACK or PUBCOMP */
+		trackAcked(mid);
+#endif
+}
+
+int papub( const char *topic, int length, void *payload, int retained, const struct PubTrack *t ){	/* Custom wrapper to publish */
+/* <- number of messages waiting to be sent or -1 on error */
+	int err, mid = 0;
+#ifdef LATENCY_STATS
+	bool acked = trackable(t);
+#endif
+		/* Counted before, as on_publish() may be called before
+		 * mosquitto_publish() returns */
+	unsigned int inflight = atomic_fetch_add(&brokerstats.inflight, 1) + 1;
+
+	if(Broker_Version == 5){
+			/* libmosquitto sends QoS 1 and 2 messages again as they are
+			 * after a reconnection, when aliases are gone : they keep
+			 * their topic */
+		bool bare = false;
+		unsigned int alias = 0;
+		mosquitto_property *props = NULL;
+
+		if(!Broker_QoS){
+			pthread_mutex_lock(&aliaslock);
+			if(atomic_load(&mosq_connected))	/* on_connect() ran for this connection */
+				alias = topicAlias(topic, &bare);
+		}
+
+		if(alias)
+			mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias);
+		char ts[24];
+		if(replayStamp(t ? t->received : 0, ts))
+			mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "ts", ts);
+		err = mosquitto_publish_v5(mosq, &mid, bare ? NULL : topic, length, payload, Broker_QoS, retained ? true : false, props);
+		mosquitto_property_free_all(&props);
+
+		if(err != MOSQ_ERR_SUCCESS)
+			aliasesForget();
+		if(!Broker_QoS)
+			pthread_mutex_unlock(&aliaslock);
+	} else
+		err = mosquitto_publish(mosq, &mid, topic, length, payload, Broker_QoS, retained ? true : false);
+#ifdef LATENCY_STATS
+	if(err == MOSQ_ERR_SUCCESS)
+		trackSent(t, acked, mid);
+#endif
+
+	if(err != MOSQ_ERR_SUCCESS){
+		inflightDone();
+		fprintf(stderr, "*E* Can't publish '%s' : %s\n", topic, mosquitto_strerror(err));
+		return -1;
+	}
+
+	return inflight;
 }
 #elif USE_PAHO
 	/*
@@ -347,24 +948,445 @@ static void connlost(void *ctx, char *cause){
 	printf("*W* Broker connection lost due to %s\n", cause);
 }
 
-int papub( const char *topic, int length, void *payload, int retained ){	/* Custom wrapper to publish */
+#ifdef LATENCY_STATS
+static void deliverycomplete(void *ctx, MQTTClient_deliveryToken dt){
+	if(Broker_QoS)
+		trackAcked(dt);
+}
+#else
+#	define deliverycomplete NULL
+#endif
+
+static int brokerConnect(void){
+	if(Broker_Version == 5){
+		MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer5;
+		conn_opts.reliable = 0;
+
+		MQTTResponse r = MQTTClient_connect5( client, &conn_opts, NULL, NULL);
+		int err = r.reasonCode;
+		if(err == MQTTCLIENT_SUCCESS){
+			int max = r.properties ? MQTTProperties_getNumericValue(r.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM) : 0;
+			aliasesConnected(max > 0 ? max : 0);	/* negative if not sent */
+		}
+		MQTTResponse_free(r);
+		return err;
+	}
+
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	conn_opts.reliable = 0;
+
+	return MQTTClient_connect( client, &conn_opts);
+}
+
+bool brokerConnected(void){
+	return MQTTClient_isConnected(client);
+}
+
+void brokerReconnect(void){
+/* Paho's synchronous client doesn't reconnect by itself */
+	static time_t last = 0;
+	time_t now = time(NULL);
+
+	if(now - last < BRK_RECONNECT)
+		return;
+	last = now;
+
+	int err = brokerConnect();
+	if(err != MQTTCLIENT_SUCCESS)
+		printf("*W* Can't reconnect to the broker (%d)\n", err);
+	else if(debug)
+		puts("*I* Reconnected to the broker");
+}
+
+int papub( const char *topic, int length, void *payload, int retained, const struct PubTrack *t ){	/* Custom wrapper to publish */
 	MQTTClient_message pubmsg = MQTTClient_message_initializer;
+	MQTTClient_deliveryToken dt = 0;
+	pubmsg.qos = Broker_QoS;
 	pubmsg.retained = retained;
 	pubmsg.payloadlen = length;
 	pubmsg.payload = payload;
 
-	return MQTTClient_publishMessage( client, topic, &pubmsg, NULL);
+	int err;
+#ifdef LATENCY_STATS
+	bool acked = trackable(t);
+#endif
+	if(Broker_Version == 5){
+		bool bare;
+		MQTTProperty alias;
+		alias.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+		if((alias.value.integer2 = topicAlias(topic, &bare)))
+			MQTTProperties_add(&pubmsg.properties, &alias);
+
+		char ts[24];
+		if(replayStamp(t ? t->received : 0, ts)){
+			MQTTProperty prop;
+			prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+			prop.value.data.data = "ts";
+			prop.value.data.len = 2;
+			prop.value.value.data = ts;
+			prop.value.value.len = strlen(ts);
+			MQTTProperties_add(&pubmsg.properties, &prop);
+		}
+
+		MQTTResponse r = MQTTClient_publishMessage5( client, bare ? "" : topic, &pubmsg, &dt);
+		err = r.reasonCode;
+		MQTTResponse_free(r);
+		MQTTProperties_free(&pubmsg.properties);
+	} else
+		err = MQTTClient_publishMessage( client, topic, &pubmsg, &dt);
+#ifdef LATENCY_STATS
+	if(err == MQTTCLIENT_SUCCESS)
+		trackSent(t, acked, dt);
+#endif
+
+	if(err == MQTTCLIENT_SUCCESS)
+		atomic_fetch_add(&brokerstats.delivered, 1);
+	else {
+		atomic_fetch_add(&brokerstats.failed, 1);
+		if(Broker_Version == 5)
+			aliasesForget();
+	}
+	return err;
+}
+#elif defined(USE_PAHO_ASYNC)
+	/*
+	 * Paho's asynchronous functions
+	 *
+	 * Up to Broker_Inflight messages are sent without waiting for the
+	 * broker : each one owns a slot keeping its own copy until the library
+	 * confirms its delivery (PUBACK for QoS 1, PUBCOMP for QoS 2, written
+	 * for QoS 0). When the window is full, papub() waits for a slot.
+	 * Once a mqtt: sink publishes, half of the window is reserved to sinks'
+	 * batches (papubSecondary()) : they never wait and are lost when their
+	 * share is full, sections' publishers keeping the other half. So a busy
+	 * sink doesn't hold up the broker's topics, nor do they starve it.
+	 * A failed delivery is sent again up to BRK_RETRIES times, after the
+	 * reconnection if the connection is lost.
+	 */
+struct Inflight {
+	struct Inflight *next;	/* free slots */
+	char *topic;
+	void *payload;
+	size_t tsz, psz;		/* allocated sizes */
+	int length;
+	int retained;
+	unsigned int tries;
+	bool pending;			/* to be sent again once reconnected */
+	unsigned int alias;		/* MQTT 5 topic alias, 0 if none */
+	bool bare;				/* the alias is enough (first attempt only) */
+	int64_t received;		/* replayed from a spool : its reception (see Spool.c) */
+	bool secondary;			/* published by a sink */
+#ifdef LATENCY_STATS
+	bool tracked;			/* its latency ends on acknowledgement */
+	struct PubTrack track;
+#endif
+};
+
+static struct Inflight *slots, *freeslots;
+static unsigned int nbfree, nbsecondary;	/* protected by inflock */
+static unsigned int secshare;	/* slots reserved to sinks (0 : none) */
+static bool secondaries;		/* a sink published, its share is reserved */
+static pthread_mutex_t inflock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t infcond = PTHREAD_COND_INITIALIZER;
+static bool async_connected;	/* protected by inflock */
+
+static sem_t connsem;	/* initial connection's outcome */
+static int connrc;
+
+static void initSlots(void){
+	assert((slots = cfgCalloc(Broker_Inflight, sizeof(struct Inflight))));
+	for(unsigned int i=0; i<Broker_Inflight; i++){
+#ifdef SMALL_FOOTPRINT	/* Largest messages, as nothing can grow once running */
+		assert((slots[i].topic = cfgAlloc(MAXLINE)));
+		slots[i].tsz = MAXLINE;
+		assert((slots[i].payload = cfgAlloc(FRAMEBATCH_SZ)));
+		slots[i].psz = FRAMEBATCH_SZ;
+#endif
+		slots[i].next = freeslots;
+		freeslots = slots + i;
+	}
+	nbfree = Broker_Inflight;
+	secshare = Broker_Inflight/2;
+}
+
+static void releaseSlot(struct Inflight *sl){
+	atomic_fetch_sub(&brokerstats.inflight, 1);
+
+	pthread_mutex_lock(&inflock);
+	sl->next = freeslots;
+	freeslots = sl;
+	nbfree++;
+	if(sl->secondary)
+		nbsecondary--;
+	pthread_cond_signal(&infcond);
+	pthread_mutex_unlock(&inflock);
+}
+
+static void onDelivered(void *, MQTTAsync_successData *);
+static void onUndelivered(void *, MQTTAsync_failureData *);
+
+static int asyncSend(struct Inflight *sl){
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+
+	opts.onSuccess = onDelivered;
+	opts.onFailure = onUndelivered;
+	opts.context = sl;
+
+	pubmsg.qos = Broker_QoS;
+	pubmsg.retained = sl->retained;
+	pubmsg.payloadlen = sl->length;
+	pubmsg.payload = sl->payload;
+
+	if(sl->alias){
+		MQTTProperty alias;
+		alias.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+		alias.value.integer2 = sl->alias;
+		MQTTProperties_add(&pubmsg.properties, &alias);
+	}
+
+	char ts[24];
+	if(Broker_Version == 5 && replayStamp(sl->received, ts)){
+		MQTTProperty prop;
+		prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+		prop.value.data.data = "ts";
+		prop.value.data.len = 2;
+		prop.value.value.data = ts;
+		prop.value.value.len = strlen(ts);
+		MQTTProperties_add(&pubmsg.properties, &prop);
+	}
+
+		/* An attempt sent again may be on a new connection, where the
+		 * alias isn't known anymore */
+	bool bare = sl->bare && !sl->tries;
+	sl->tries++;
+	int err = MQTTAsync_sendMessage(client, bare ? "" : sl->topic, &pubmsg, &opts);
+	MQTTProperties_free(&pubmsg.properties);
+	return err;
+}
+
+static void giveUp(struct Inflight *sl){
+	atomic_fetch_add(&brokerstats.lost, 1);
+	fprintf(stderr, "*E* '%s' lost after %u attempts\n", sl->topic, sl->tries);
+	releaseSlot(sl);
+}
+
+static void onDelivered(void *ctx, MQTTAsync_successData *resp){
+	struct Inflight *sl = (struct Inflight *)ctx;
+
+	atomic_fetch_add(&brokerstats.delivered, 1);
+#ifdef LATENCY_STATS
+	if(sl->tracked)
+		latencyDelivered(&sl->track);
+#endif
+	releaseSlot(sl);
+}
+
+static void onUndelivered(void *ctx, MQTTAsync_failureData *resp){
+	struct Inflight *sl = (struct Inflight *)ctx;
+
+	atomic_fetch_add(&brokerstats.failed, 1);
+	if(sl->alias)
+		aliasesForget();
+	if(debug)
+		printf("*d* Delivery of '%s' failed : %s\n", sl->topic,
+			(resp && resp->message) ? resp->message : MQTTAsync_strerror(resp ? resp->code : MQTTASYNC_FAILURE)
+		);
+
+	if(sl->tries >= BRK_RETRIES){
+		giveUp(sl);
+		return;
+	}
+	atomic_fetch_add(&brokerstats.retried, 1);
+
+	pthread_mutex_lock(&inflock);
+	if(!async_connected){	/* onConnected() will send it */
+		sl->pending = true;
+		pthread_mutex_unlock(&inflock);
+		return;
+	}
+	pthread_mutex_unlock(&inflock);
+
+	if(asyncSend(sl) != MQTTASYNC_SUCCESS)
+		giveUp(sl);
+}
+
+static void onConnected(void *ctx, char *cause){
+/* Initial connection or automatic reconnection */
+	if(Broker_Version == 5 && cause)	/* Reconnected to the same broker */
+		aliasesConnected(-1);
+
+	pthread_mutex_lock(&inflock);
+	async_connected = true;
+	pthread_cond_broadcast(&infcond);
+	pthread_mutex_unlock(&inflock);
+
+	if(debug)
+		puts("*I* Connected to the broker");
+
+	for(unsigned int i=0; i<Broker_Inflight; i++){
+		pthread_mutex_lock(&inflock);
+		bool p = slots[i].pending;
+		slots[i].pending = false;
+		pthread_mutex_unlock(&inflock);
+
+		if(p && asyncSend(slots + i) != MQTTASYNC_SUCCESS)
+			giveUp(slots + i);
+	}
+}
+
+static void connlost(void *ctx, char *cause){
+	pthread_mutex_lock(&inflock);
+	async_connected = false;
+	pthread_cond_broadcast(&infcond);	/* papub() mustn't wait anymore */
+	pthread_mutex_unlock(&inflock);
+	if(Broker_Version == 5)
+		aliasesDisconnected();
+
+	printf("*W* Broker connection lost due to %s\n", cause ? cause : "unknown reason");
+}
+
+static int msgarrived(void *ctx, char *topic, int tlen, MQTTAsync_message *msg){
+	if(debug)
+		printf("*I* Unexpected message arrival (topic : '%s')\n", topic);
+
+	MQTTAsync_freeMessage(&msg);
+	MQTTAsync_free(topic);
+	return 1;
+}
+
+static void onConnect(void *ctx, MQTTAsync_successData *resp){
+	connrc = MQTTASYNC_SUCCESS;
+	onConnected(ctx, NULL);
+	sem_post(&connsem);
+}
+
+static void onConnect5(void *ctx, MQTTAsync_successData5 *resp){
+	int max = MQTTProperties_getNumericValue(&resp->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+	aliasesConnected(max > 0 ? max : 0);	/* negative if not sent */
+	onConnect(ctx, NULL);
+}
+
+static void onConnectFailure(void *ctx, MQTTAsync_failureData *resp){
+	connrc = resp ? resp->code : MQTTASYNC_FAILURE;
+	sem_post(&connsem);
+}
+
+bool brokerConnected(void){
+	pthread_mutex_lock(&inflock);
+	bool ret = async_connected;
+	pthread_mutex_unlock(&inflock);
+	return ret;
+}
+
+void brokerReconnect(void){
+	/* Done by Paho itself (automaticReconnect) */
+}
+
+static bool growCopy(void **dst, size_t *sz, const void *src, size_t len){
+	if(len > *sz){
+#ifdef SMALL_FOOTPRINT
+		return false;
+#endif
+		void *n = realloc(*dst, len);
+		if(!n)
+			return false;
+		*dst = n;
+		*sz = len;
+	}
+	memcpy(*dst, src, len);
+	return true;
+}
+
+static int asyncPublish( const char *topic, int length, void *payload, int retained, const struct PubTrack *t, bool secondary ){
+/* <- number of messages in flight or -1 on error */
+	struct Inflight *sl;
+
+	pthread_mutex_lock(&inflock);
+	if(secondary){	/* Never waits */
+		secondaries = true;
+		if(!freeslots || nbsecondary >= (secshare ? secshare : 1)){
+			pthread_mutex_unlock(&inflock);
+			return -1;
+		}
+	}
+	while(!(sl = freeslots) ||	/* Window is full */
+	  (!secondary && secondaries && nbfree <= secshare - nbsecondary)){	/* ... for sections */
+		if(!async_connected){
+			pthread_mutex_unlock(&inflock);
+			return -1;
+		}
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&infcond, &inflock, &ts);
+	}
+	freeslots = sl->next;
+	nbfree--;
+	if((sl->secondary = secondary))
+		nbsecondary++;
+	pthread_mutex_unlock(&inflock);
+
+	atomic_fetch_add(&brokerstats.inflight, 1);
+	if(!growCopy((void **)&sl->topic, &sl->tsz, topic, strlen(topic) + 1) ||
+	   !growCopy(&sl->payload, &sl->psz, payload, length)){
+		fputs("*E* Can't allocate an in-flight message\n", stderr);
+		releaseSlot(sl);
+		return -1;
+	}
+	sl->length = length;
+	sl->retained = retained;
+	sl->tries = 0;
+	sl->pending = false;
+	sl->alias = (Broker_Version == 5) ? topicAlias(topic, &sl->bare) : 0;
+	sl->received = t ? t->received : 0;
+#ifdef LATENCY_STATS
+	if((sl->tracked = t && t->section && Broker_QoS))	/* QoS 0 : delivered once sent */
+		sl->track = *t;
+#endif
+
+	int err = asyncSend(sl);
+	if(err != MQTTASYNC_SUCCESS){
+		if(sl->alias)
+			aliasesForget();
+		fprintf(stderr, "*E* Can't publish '%s' : %s\n", topic, MQTTAsync_strerror(err));
+		atomic_fetch_add(&brokerstats.failed, 1);
+		releaseSlot(sl);
+		return -1;
+	}
+#ifdef LATENCY_STATS
+	if(t && t->section && !Broker_QoS)
+		latencyDelivered(t);
+#endif
+
+	return atomic_load(&brokerstats.inflight);
+}
+
+int papub( const char *topic, int length, void *payload, int retained, const struct PubTrack *t ){	/* Custom wrapper to publish */
+	return asyncPublish(topic, length, payload, retained, t, false);
+}
+
+int papubSecondary( const char *topic, int length, void *payload, int retained ){
+	return asyncPublish(topic, length, payload, retained, NULL, true);
 }
 #endif
 
 static void theend(void){
 		/* Some cleanup */
 #ifdef USE_MOSQUITTO
+	mosquitto_disconnect(mosq);
+	mosquitto_loop_stop(mosq, false);
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
 #elif defined(USE_PAHO)
 	MQTTClient_disconnect(client, 10000);	/* 10s for the grace period */
 	MQTTClient_destroy(&client);
+#elif defined(USE_PAHO_ASYNC)
+	MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+	opts.timeout = 10000;	/* 10s for the grace period */
+	MQTTAsync_disconnect(client, &opts);
+	MQTTAsync_destroy(&client);
 #endif
 }
 
@@ -375,6 +1397,18 @@ void handleInt(int na){
 int main(int ac, char **av){
 	const char *conf_file = DEFAULT_CONFIGURATION_FILE;
 	
+		/* SIGHUP is only waited for by the main thread (reload) : blocked
+		 * before any thread (ours or MQTT library's one) is created, so
+		 * all of them inherit it */
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+#ifdef SMALL_FOOTPRINT
+	mallopt(M_ARENA_MAX, 1);	/* No per thread malloc arena */
+#endif
+
 		/* reading arguments */
 	int opt;
 	while((opt = getopt(ac, av, "hdvDf:")) != -1){
@@ -405,8 +1439,7 @@ int main(int ac, char **av){
 		}
 	}
 
-	sections = NULL;
-	read_configuration( conf_file );
+	sections = read_configuration( conf_file, false );
 
 	if(!sections){
 		fputs("*F* No section defined : giving up ...\n", stderr);
@@ -419,33 +1452,25 @@ int main(int ac, char **av){
 	}
 
 	for(struct CSection *s = sections ; s; s = s->next){
-		if(!s->port){
-			fprintf( stderr, "*F* No port defined for section '%s'\n", s->name );
-			exit(EXIT_FAILURE);
-		}
-
-		if(!s->labels){
-			fprintf( stderr, "*F* Publishing missing for section '%s'\n", s->name );
-			exit(EXIT_FAILURE);
-		}
-
-		if(s->standard){	/* check specifics for standard frames */
-			if(!s->topic && !s->cctopic && !s->cptopic){
-				fprintf( stderr, "*F* at least Topic, ConvCons or ConvProd has to be provided for standard section '%s'\n", s->name );
-				exit(EXIT_FAILURE);
-			}
-		} else {	/* check specifics for historic frames */
-			if(!s->topic){
-				fprintf( stderr, "*F* Topic is mandatory for historic section '%s'\n", s->name );
-				exit(EXIT_FAILURE);
-			}
-		}
+		checkSection(s);
+		initQueue(&s->queue, Queue_Size);
+		if(s->spoolfile)
+			initSpool(s, Spool_Size);
+		if(s->storedir)
+			initStore(s, Store_Segment, Store_Keep);
+		if(s->snapshot)
+			initSnapshot(s);
+		if(s->sinks)
+			initSinks(s, Queue_Size);
 	}
 
 	if(debug)
 		puts("PASSED\n");
 
 		/* Connecting to the broker */
+	if(Broker_Version == 5)
+		initAliases(Broker_Aliases);
+
 #ifdef USE_MOSQUITTO
 	mosquitto_lib_init();
 	if(!(mosq = mosquitto_new(
@@ -458,6 +1483,15 @@ int main(int ac, char **av){
 		exit(EXIT_FAILURE);
 	}
 
+	if(Broker_Version == 5){
+		mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+		mosquitto_connect_v5_callback_set(mosq, on_connect_v5);
+	} else
+		mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+	mosquitto_publish_callback_set(mosq, on_publish);
+	mosquitto_reconnect_delay_set(mosq, 1, BRK_KEEPALIVE, true);
+
 	switch( mosquitto_connect(mosq, Broker_Host, Broker_Port, BRK_KEEPALIVE) ){
 	case MOSQ_ERR_INVAL:
 		fputs("Invalid parameter for mosquitto_connect()\n", stderr);
@@ -473,19 +1507,27 @@ int main(int ac, char **av){
 		if(debug)
 			puts("Connected using Mosquitto library");
 	}
+
+	if(mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS){
+		fputs("*F* Can't start Mosquitto's network loop\n", stderr);
+		mosquitto_destroy(mosq);
+		mosquitto_lib_cleanup();
+		exit(EXIT_FAILURE);
+	}
 #elif defined(USE_PAHO)
 	{
-		MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-		conn_opts.reliable = 0;
-
 		int err;
-		if((err = MQTTClient_create( &client, Broker_Host, "TeleInfod", MQTTCLIENT_PERSISTENCE_NONE, NULL)) != MQTTCLIENT_SUCCESS){
+		MQTTClient_createOptions create_opts = MQTTClient_createOptions_initializer;
+		if(Broker_Version == 5)
+			create_opts.MQTTVersion = MQTTVERSION_5;
+
+		if((err = MQTTClient_createWithOptions( &client, Broker_Host, "TeleInfod", MQTTCLIENT_PERSISTENCE_NONE, NULL, &create_opts)) != MQTTCLIENT_SUCCESS){
 			fprintf(stderr, "Failed to create client : %d\n", err);
 			exit(EXIT_FAILURE);
 		}
-		MQTTClient_setCallbacks( client, NULL, connlost, msgarrived, NULL);
+		MQTTClient_setCallbacks( client, NULL, connlost, msgarrived, deliverycomplete);
 
-		switch( (err = MQTTClient_connect( client, &conn_opts)) ){
+		switch( (err = brokerConnect()) ){
 		case MQTTCLIENT_SUCCESS : 
 			break;
 		case 1 : fputs("Unable to connect : Unacceptable protocol version\n", stderr);
@@ -506,6 +1548,50 @@ int main(int ac, char **av){
 			exit(EXIT_FAILURE);
 		}
 	}
+#elif defined(USE_PAHO_ASYNC)
+	{
+		int err;
+		MQTTAsync_createOptions create_opts = MQTTAsync_createOptions_initializer;
+		if(Broker_Version == 5)
+			create_opts.MQTTVersion = MQTTVERSION_5;
+
+		if((err = MQTTAsync_createWithOptions( &client, Broker_Host, "TeleInfod", MQTTCLIENT_PERSISTENCE_NONE, NULL, &create_opts)) != MQTTASYNC_SUCCESS){
+			fprintf(stderr, "Failed to create client : %d\n", err);
+			exit(EXIT_FAILURE);
+		}
+		initSlots();
+		sem_init(&connsem, 0, 0);
+		MQTTAsync_setCallbacks( client, NULL, connlost, msgarrived, NULL);
+		MQTTAsync_setConnected( client, NULL, onConnected);
+
+		MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+		if(Broker_Version == 5){
+			MQTTAsync_connectOptions opts5 = MQTTAsync_connectOptions_initializer5;
+			conn_opts = opts5;
+		}
+		conn_opts.keepAliveInterval = BRK_KEEPALIVE;
+		conn_opts.maxInflight = Broker_Inflight;
+		conn_opts.automaticReconnect = 1;
+		conn_opts.minRetryInterval = 1;
+		conn_opts.maxRetryInterval = BRK_KEEPALIVE;
+		if(Broker_Version == 5)
+			conn_opts.onSuccess5 = onConnect5;	/* to get the CONNACK's properties */
+		else
+			conn_opts.onSuccess = onConnect;
+		conn_opts.onFailure = onConnectFailure;
+
+		if((err = MQTTAsync_connect( client, &conn_opts)) != MQTTASYNC_SUCCESS){
+			fprintf(stderr, "Unable to connect : %s\n", MQTTAsync_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+		while(sem_wait(&connsem) == -1);	/* Interrupted */
+		if(connrc != MQTTASYNC_SUCCESS){
+			fprintf(stderr, "Unable to connect : %s\n", MQTTAsync_strerror(connrc));
+			exit(EXIT_FAILURE);
+		}
+		if(debug)
+			printf("Connected using Paho asynchronous library (%u messages in flight)\n", Broker_Inflight);
+	}
 #endif
 
 	atexit(theend);
@@ -513,21 +1599,31 @@ int main(int ac, char **av){
 	if(debug)
 		puts("Starting ...");
 
-		/* Creation of reading threads */
-	pthread_attr_t thread_attr;
-	assert(!pthread_attr_init (&thread_attr));
-	assert(!pthread_attr_setdetachstate (&thread_attr, PTHREAD_CREATE_DETACHED));
+#ifdef LATENCY_STATS
+	initLatency(sections, Latency_Topic, Latency_Interval);
+#endif
+	startPublisher(sections, Replay_Rate);
+	startSinks(sections);
+	if(Metrics)
+		startMetrics(sections, Metrics);
 
-	for(struct CSection *s = sections ; s; s = s->next){
-		if(s->standard){
-			if(pthread_create( &(s->thread), &thread_attr, process_standard, s) < 0){
-				fputs("*F* Can't create a processing thread\n", stderr);
-				exit(EXIT_FAILURE);
-			}
-		} else {
-			if(pthread_create( &(s->thread), &thread_attr, process_historic, s) < 0){
-				fputs("*F* Can't create a processing thread\n", stderr);
-				exit(EXIT_FAILURE);
+	if(Workers)	/* Multiplexed sections */
+		startEngine(sections, Workers);
+	else {	/* Creation of reading threads */
+		pthread_attr_t thread_attr;
+		initThreadAttr(&thread_attr);
+
+		for(struct CSection *s = sections ; s; s = s->next){
+			if(s->standard){
+				if(pthread_create( &(s->thread), &thread_attr, process_standard, s) < 0){
+					fputs("*F* Can't create a processing thread\n", stderr);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				if(pthread_create( &(s->thread), &thread_attr, process_historic, s) < 0){
+					fputs("*F* Can't create a processing thread\n", stderr);
+					exit(EXIT_FAILURE);
+				}
 			}
 		}
 	}
@@ -535,5 +1631,15 @@ int main(int ac, char **av){
 		/* Lets threads working */
 	signal(SIGINT, handleInt);
 
-	pause();	/* No summary to send : waiting for the end */
+#ifdef SMALL_FOOTPRINT
+	arenaSeal();	/* Nothing is allocated anymore */
+#endif
+
+	for(;;){	/* No summary to send : waiting for reloads until the end */
+		int sig;
+
+			/* A SIGHUP received during a reload stays pending */
+		if(!sigwait(&hup, &sig))
+			reload_configuration(conf_file);
+	}
 }
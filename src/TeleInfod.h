@@ -19,16 +19,240 @@
 #define TELEINFO_H
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 extern unsigned int debug;
+extern size_t threadstack;
+extern void initThreadAttr(pthread_attr_t *);
 
 extern char *removeLF(char *);
 extern char *striKWcmp(char *, const char *);
-extern const char *getLabel(FILE *, char *, char);
-extern const char *getPayload(FILE *, char *, char, size_t);
+extern jmp_buf *configjmp;
+extern void configError(void);
+extern void debugchar(const char);
+extern int64_t nowUS(void);
 
-extern int papub(const char *, int, void *, int);
+	/* Startup allocations : with SMALL_FOOTPRINT, they come from a single
+	 * arena, sealed once running, and are never freed */
+#ifdef SMALL_FOOTPRINT
+extern void *arenaAlloc(size_t);
+extern char *arenaStrdup(const char *);
+extern void arenaSeal(void);
+#	define cfgAlloc(sz)		arenaAlloc(sz)
+#	define cfgCalloc(n, sz)	arenaAlloc((n) * (sz))
+#	define cfgStrdup(s)		arenaStrdup(s)
+#	define cfgFree(p)		((void)(p))
+#else
+#	define cfgAlloc(sz)		malloc(sz)
+#	define cfgCalloc(n, sz)	calloc(n, sz)
+#	define cfgStrdup(s)		strdup(s)
+#	define cfgFree(p)		free(p)
+#endif
+
+	/* Buffered reader */
+#define READER_BUFSZ 1024	/* Far larger than the longest group */
+#define LABEL_MAX 9			/* Longest label (SMAXSN1-1) */
+
+struct TIGroup {	/* A group, pointing inside reader's buffer */
+	char *label;
+	char *horodate;		/* NULL if none */
+	size_t hlen;		/* horodate's length */
+	char *value;
+	size_t vlen;		/* value's length */
+	char checksum;
+};
+
+struct TIStamp {	/* Reception time (µs) */
+	int64_t mono;		/* CLOCK_MONOTONIC */
+	int64_t real;		/* CLOCK_REALTIME, since epoch */
+};
+
+struct TIFrame {	/* Frames' state machine */
+	bool inframe;			/* STX received, waiting for ETX */
+	bool follows;			/* previous frame is complete as well */
+	struct TIStamp start;	/* current (or last) frame's STX */
+	struct TIStamp prevstart;	/* previous complete frame's one */
+	struct TIStamp end;		/* last complete frame's ETX */
+	unsigned long period;	/* between the last 2 complete frames (µs) */
+	unsigned long jitter;	/* smoothed period's variation (µs) */
+	atomic_llong last;		/* end.real, for other threads */
+};
+
+struct TIReader {
+	int fd;
+	char sep;			/* Fields separator */
+	bool synced;		/* LF found : waiting for the end of the group */
+	size_t start, end;	/* unprocessed data in the buffer */
+	unsigned long nbgood, nbbad;	/* checksum statistics */
+	unsigned long nbreads, nbbytes;	/* wake ups statistics */
+	unsigned long nbframes;			/* complete frames (STX ... ETX) */
+	unsigned long nbaborted;		/* frames cut by EOT or missing STX / ETX */
+	struct TIStamp stamp;			/* current event's reception */
+	struct TIStamp readstamp, prevstamp;	/* last reads' */
+	size_t freshpos;		/* data from the last read start here */
+	struct TIFrame frame;
+	char buf[READER_BUFSZ];
+};
+
+extern void initReader(struct TIReader *, int, char);
+extern int fillReader(struct TIReader *);
+enum TIEvent {	/* Reader's stamp is the event's reception */
+	TIE_NONE = 0,	/* Need more data / end of file */
+	TIE_GROUP,		/* A valid group has been read */
+	TIE_STX,		/* Start of a frame */
+	TIE_ETX,		/* End of a complete frame */
+	TIE_EOT			/* The current frame is interrupted : discard it */
+};
+
+extern enum TIEvent nextEvent(struct TIReader *, struct TIGroup *);
+extern enum TIEvent readEvent(struct TIReader *, struct TIGroup *);
+
+	/* Serial port */
+struct CSection;
+extern bool checkBaud(unsigned int);
+extern bool parseMode(struct CSection *, const char *);
+extern bool parseReadPolicy(struct CSection *, const char *);
+extern int openPort(struct CSection *, bool);
+
+	/* Labels */
+struct LabelSet;
+struct TopicName;
+extern void compileLabels(struct CSection *);
+extern void buildTopic(struct TopicName *, const char *, const char *, const char *);
+extern struct PubLabel *findLabel(struct LabelSet *, const char *);
+extern bool valueChanged(struct CSection *, struct PubLabel *);
+extern uint64_t hashText(const char *);
+
+	/* Typed values */
+extern int64_t horodate2epoch(const char *, size_t);
+extern bool stageGroup(struct CSection *, struct PubLabel *, struct TIGroup *);
+extern void dropStaged(struct CSection *);
+extern void applyValue(struct PubLabel *);
+struct TIValue;
+extern void snapshotValue(struct PubLabel *, struct TIValue *);
+
+	/* Binary payloads */
+enum Encoding {
+	ENC_TEXT = 0,	/* Decimal strings, JSON frames */
+	ENC_CBOR,
+	ENC_MSGPACK
+};
+
+extern size_t encodeUint(enum Encoding, char *, uint64_t);
+extern size_t encodeText(enum Encoding, char *, const char *, size_t);
+extern size_t encodeStamp(enum Encoding, char *, int64_t);
+extern size_t encodeArray(enum Encoding, char *, unsigned int);
+extern size_t encodeValue(enum Encoding, char *, const struct PubLabel *);
+extern bool parseEncoding(struct CSection *, const char *);
+
+	/* Local time series */
+struct ColumnReader;
+extern void initStore(struct CSection *, unsigned int, unsigned int);
+extern void storeValue(struct CSection *, struct PubLabel *);
+extern void closeStore(struct CSection *);
+extern void storeColumns(struct LabelSet *);
+extern void closeColumns(struct LabelSet *);
+extern bool openColumnReader(struct ColumnReader *, const char *);
+extern bool columnNext(struct ColumnReader *, int64_t *, uint64_t *);
+extern void closeColumnReader(struct ColumnReader *);
+
+	/* Shared memory snapshot (see Snapshot.h) */
+struct TISnapshot;
+extern void initSnapshot(struct CSection *);
+extern void snapshotFrame(struct CSection *);
 
+	/* Whole frame publishing */
+extern void initBatch(struct CSection *);
+extern void batchStart(struct CSection *);
+extern void batchAdd(struct CSection *, struct PubLabel *, const char *);
+extern void batchAbort(struct CSection *);
+extern void batchPublish(struct CSection *);
+
+	/* Publishing queues */
+struct PubQueue;
+extern void initQueue(struct PubQueue *, size_t);
+struct QRecord;
+extern struct QRecord *qreserve(struct PubQueue *, const char *, size_t, size_t, const void *, size_t *);
+extern void qcommit(struct PubQueue *, size_t);
+extern bool qpublish(struct CSection *, const char *, size_t, int, const void *, int);
+extern void startPublisher(struct CSection *, unsigned int);
+
+	/* Additional outputs */
+struct PubLabel;
+extern bool parseSink(struct CSection *, const char *);
+extern void initSinks(struct CSection *, size_t);
+extern void sinkValue(struct CSection *, struct PubLabel *);
+extern void startSinks(struct CSection *);
+extern void freeSinks(struct CSection *);
+
+	/* Store and forward */
+extern void initSpool(struct CSection *, size_t);
+extern bool spoolEmpty(struct CSection *);
+extern void spoolAppend(struct CSection *, const struct QRecord *);
+extern unsigned int spoolReplay(struct CSection *, unsigned int);
+
+extern bool brokerConnected(void);
+extern void brokerReconnect(void);
+
+struct PubTrack {	/* Whose latency ends when a message is delivered */
+	struct CSection *section;	/* NULL : not accounted */
+	int64_t stamp;		/* queued at */
+	uint32_t age;		/* reception -> queued (µs) */
+	int64_t received;	/* replayed from a spool : its reception (µs since epoch), 0 if live */
+};
+extern int papub(const char *, int, void *, int, const struct PubTrack *);
+#ifdef USE_PAHO_ASYNC	/* Doesn't wait for nor starve sections' in-flight window */
+extern int papubSecondary(const char *, int, void *, int);
+#else
+#define papubSecondary(topic, len, payload, retained) papub(topic, len, payload, retained, NULL)
+#endif
+
+	/* MQTT 5 topic aliases */
+extern void initAliases(unsigned int);
+extern void aliasesConnected(int);
+extern void aliasesForget(void);
+extern void aliasesDisconnected(void);
+extern unsigned int topicAlias(const char *, bool *);
+
+	/* Frames handling */
+extern void initHistoric(struct CSection *);
+extern void handleHistoric(struct CSection *, enum TIEvent, struct TIGroup *);
 extern void *process_historic(void *);
+extern void initStandard(struct CSection *);
+extern void handleStandard(struct CSection *, enum TIEvent, struct TIGroup *);
 extern void *process_standard(void *);
+
+	/* Latency histograms */
+#ifdef LATENCY_STATS
+enum LatencyStage {
+	LS_READ = 0,	/* Reception -> parsed */
+	LS_PROCESS,		/* Parsed -> queued */
+	LS_QUEUE,		/* Queued -> delivered */
+	LS_TOTAL,		/* Reception -> delivered */
+	LS_NB
+};
+
+extern void latencyRecord(struct CSection *, enum LatencyStage, int64_t);
+extern void latencyParsed(struct CSection *);
+extern void latencyDelivered(const struct PubTrack *);
+extern void initLatency(struct CSection *, const char *, unsigned int);
+extern void latencyService(struct CSection *);
+#endif
+
+	/* Hot reload */
+extern void applyConfiguration(struct CSection *);
+extern void freeConfiguration(struct CSection *);
+
+	/* Scrape endpoint */
+extern void startMetrics(struct CSection *, const char *);
+extern void metricsQuiesce(void);
+
+	/* Multiplexed engine */
+extern void streamClosed(struct CSection *);
+extern void startEngine(struct CSection *, unsigned int);
 #endif